@@ -0,0 +1,146 @@
+#include "admission.h"
+#include "assert.h"
+
+#include <fstream>
+#include <string>
+
+// PSI "some avg10" percentages above which no new jobs are started
+#define PSI_MEMORY_LIMIT 10.0
+#define PSI_CPU_LIMIT 60.0
+#define PSI_POLL_INTERVAL_MS 500
+
+// Returns the "some avg10" percentage of a PSI file, or 0 when unavailable
+static double read_psi_some_avg10(const char *path)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) return 0;
+    std::string kind, avg10;
+    while (file >> kind >> avg10) {
+        std::string rest;
+        std::getline(file, rest);
+        if ((kind == "some") && (avg10.compare(0, 6, "avg10=") == 0)) {
+            return strtod(avg10.c_str() + 6, nullptr);
+        }
+    }
+    return 0;
+}
+
+uint64_t available_memory_kb()
+{
+    std::ifstream file("/proc/meminfo");
+    if (!file.is_open()) return 0;
+    std::string key, unit;
+    uint64_t value;
+    while (file >> key >> value) {
+        std::getline(file, unit);
+        if (key == "MemAvailable:") return value;
+    }
+    return 0;
+}
+
+AdmissionControl::AdmissionControl(uint64_t memory_budget_kb, uint32_t cores_budget_milli)
+    : m_memory_budget_kb(memory_budget_kb)
+    , m_cores_budget_milli(cores_budget_milli)
+{
+}
+
+std::chrono::milliseconds AdmissionControl::pressure_poll_interval()
+{
+    return std::chrono::milliseconds(PSI_POLL_INTERVAL_MS);
+}
+
+// Called with m_mtx held
+bool AdmissionControl::under_pressure()
+{
+    const auto now = std::chrono::steady_clock::now();
+    if (now - m_last_poll < pressure_poll_interval()) return m_pressure;
+    m_last_poll = now;
+    const double memory = read_psi_some_avg10("/proc/pressure/memory");
+    const double cpu = read_psi_some_avg10("/proc/pressure/cpu");
+    const bool pressure = (memory > PSI_MEMORY_LIMIT) || (cpu > PSI_CPU_LIMIT);
+    if (pressure != m_pressure) {
+        PRINT("Pressure " << (pressure ? "high" : "back to normal")
+              << ": memory " << memory << "%, cpu " << cpu << "%");
+    }
+    m_pressure = pressure;
+    return m_pressure;
+}
+
+bool AdmissionControl::try_admit(const ResourceDemand &demand)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    m_backing_off = false;
+    if (m_running > 0) {
+        if (under_pressure()) {
+            m_held_for_pressure++;
+            m_backing_off = true;
+            return false;
+        }
+        if ((m_memory_budget_kb > 0) && (m_rss_kb + demand.rss_kb > m_memory_budget_kb)) {
+            m_held_for_memory++;
+            return false;
+        }
+        if ((m_cores_budget_milli > 0) && (m_cores_milli + demand.cores_milli > m_cores_budget_milli)) {
+            m_held_for_cores++;
+            return false;
+        }
+    }
+    lck.unlock();
+    force_admit(demand);
+    return true;
+}
+
+void AdmissionControl::force_admit(const ResourceDemand &demand)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    m_running++;
+    m_rss_kb += demand.rss_kb;
+    m_cores_milli += demand.cores_milli;
+    if (m_rss_kb > m_peak_rss_kb) m_peak_rss_kb = m_rss_kb;
+    if (m_cores_milli > m_peak_cores_milli) m_peak_cores_milli = m_cores_milli;
+}
+
+void AdmissionControl::release(const ResourceDemand &demand)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    ASSERT(m_running > 0);
+    ASSERT(m_rss_kb >= demand.rss_kb);
+    m_running--;
+    m_rss_kb -= demand.rss_kb;
+}
+
+void AdmissionControl::release_cores(uint32_t cores_milli)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    ASSERT(m_cores_milli >= cores_milli);
+    m_cores_milli -= cores_milli;
+}
+
+void AdmissionControl::readmit_cores(uint32_t cores_milli)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    m_cores_milli += cores_milli;
+    if (m_cores_milli > m_peak_cores_milli) m_peak_cores_milli = m_cores_milli;
+}
+
+void AdmissionControl::set_cores_budget_milli(uint32_t cores_budget_milli)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    m_cores_budget_milli = cores_budget_milli;
+}
+
+bool AdmissionControl::backing_off() const
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    return m_backing_off;
+}
+
+void AdmissionControl::print_report() const
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    PRINT("Admission: peak " << (m_peak_rss_kb / 1024) << "/" << (m_memory_budget_kb / 1024) << " MiB, "
+          << (m_peak_cores_milli / 1000.0) << "/" << (m_cores_budget_milli / 1000.0) << " cores; "
+          << "held back " << m_held_for_memory << "x for memory, "
+          << m_held_for_cores << "x for cores, "
+          << m_held_for_pressure << "x for pressure");
+}
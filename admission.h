@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cinttypes>
+#include <chrono>
+#include <mutex>
+
+// What a rule is expected to take while it runs, from previous builds
+struct ResourceDemand {
+    uint64_t rss_kb = 0;
+    uint32_t cores_milli = 0; // average cores busy, in thousandths
+};
+
+/* Decides whether another job may start, given the memory and cores of
+ * the jobs already admitted. A job is always admitted when nothing else
+ * is running, so a rule bigger than the whole budget still gets to run
+ * on its own.
+ *
+ * On top of the budgets, the kernel's pressure stall information is
+ * polled every so often; while memory or CPU pressure is above its
+ * limit, nothing new is admitted until running jobs drain.
+ *
+ * A job's cores go back with its execution token, whenever it gives that
+ * up, e.g. while blocked on an input, and its memory once it is gone. */
+class AdmissionControl {
+public:
+    AdmissionControl(uint64_t memory_budget_kb, uint32_t cores_budget_milli);
+
+    bool try_admit(const ResourceDemand &demand);
+    // For jobs that must start regardless, e.g. ones a running job waits on
+    void force_admit(const ResourceDemand &demand);
+    // The memory of a job that is gone; its cores went with its token
+    void release(const ResourceDemand &demand);
+    void release_cores(uint32_t cores_milli);
+    void readmit_cores(uint32_t cores_milli);
+    // Follows the job limit, which autotune may move while the build runs
+    void set_cores_budget_milli(uint32_t cores_budget_milli);
+
+    // Whether the last refusal was due to pressure rather than budget:
+    // that only clears with time, so the caller should retry on a timer
+    bool backing_off() const;
+    static std::chrono::milliseconds pressure_poll_interval();
+
+    uint64_t memory_budget_kb() const { return m_memory_budget_kb; }
+    void print_report() const;
+
+    AdmissionControl(const AdmissionControl &) =delete;
+    AdmissionControl& operator=(const AdmissionControl &) =delete;
+
+private:
+    bool under_pressure();
+
+    const uint64_t m_memory_budget_kb;
+
+    mutable std::mutex m_mtx;
+    uint32_t m_cores_budget_milli;
+    uint32_t m_running = 0;
+    uint64_t m_rss_kb = 0;
+    uint64_t m_cores_milli = 0;
+    uint64_t m_peak_rss_kb = 0;
+    uint64_t m_peak_cores_milli = 0;
+
+    std::chrono::steady_clock::time_point m_last_poll;
+    bool m_pressure = false;
+    bool m_backing_off = false;
+
+    uint64_t m_held_for_memory = 0;
+    uint64_t m_held_for_cores = 0;
+    uint64_t m_held_for_pressure = 0;
+};
+
+// MemAvailable from /proc/meminfo, or 0 when unknown
+uint64_t available_memory_kb();
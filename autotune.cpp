@@ -0,0 +1,82 @@
+#include "autotune.h"
+#include "assert.h"
+
+#include <fstream>
+#include <string>
+
+#define WINDOW_MS 500
+// Fractions of all CPU time in a window
+#define CPU_SATURATED 0.95
+#define CPU_SPARE 0.75
+#define IOWAIT_HIGH 0.10
+// Throughput changes smaller than this are noise
+#define THROUGHPUT_TOLERANCE 0.05
+
+ParallelismTuner::ParallelismTuner(uint32_t initial, uint32_t min, uint32_t max)
+    : m_min(min)
+    , m_max(max)
+    , m_limit(initial)
+    , m_window_start(std::chrono::steady_clock::now())
+    , m_window_cpu(read_cpu_times())
+{
+    ASSERT((min > 0) && (min <= initial) && (initial <= max));
+}
+
+ParallelismTuner::CpuTimes ParallelismTuner::read_cpu_times()
+{
+    // cpu  user nice system idle iowait irq softirq steal ...
+    CpuTimes times;
+    std::ifstream file("/proc/stat");
+    std::string label;
+    if (!(file >> label) || (label != "cpu")) return times;
+    for (uint32_t field = 0; field < 8; field++) {
+        uint64_t value;
+        if (!(file >> value)) break;
+        times.total += value;
+        if (field == 3) times.idle = value;
+        if (field == 4) times.iowait = value;
+    }
+    return times;
+}
+
+void ParallelismTuner::tick(bool backlog)
+{
+    m_window_backlog |= backlog;
+    const auto now = std::chrono::steady_clock::now();
+    const uint64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - m_window_start).count();
+    if (elapsed_ms < WINDOW_MS) return;
+
+    const CpuTimes cpu = read_cpu_times();
+    const double total = (cpu.total > m_window_cpu.total) ? (cpu.total - m_window_cpu.total) : 1;
+    const double iowait = (cpu.iowait - m_window_cpu.iowait) / total;
+    const double busy = 1.0 - (cpu.idle - m_window_cpu.idle) / total - iowait;
+    const double throughput = m_finished * 1000.0 / elapsed_ms;
+    const bool window_backlog = m_window_backlog;
+
+    m_window_start = now;
+    m_window_cpu = cpu;
+    m_finished = 0;
+    m_window_backlog = false;
+
+    if (!window_backlog) {
+        m_prev_throughput = 0;
+        return;
+    }
+
+    if ((m_prev_throughput > 0) && (throughput < m_prev_throughput * (1.0 - THROUGHPUT_TOLERANCE))) {
+        m_direction = -m_direction;
+    } else if ((busy > CPU_SATURATED) && (iowait < IOWAIT_HIGH)) {
+        m_direction = -1;
+    } else if ((busy < CPU_SPARE) || (iowait > IOWAIT_HIGH)) {
+        m_direction = 1;
+    }
+    m_prev_throughput = throughput;
+
+    const uint32_t old_limit = m_limit;
+    if ((m_direction > 0) && (m_limit < m_max)) m_limit++;
+    if ((m_direction < 0) && (m_limit > m_min)) m_limit--;
+    if (m_limit == old_limit) return;
+    PRINT("Parallelism " << old_limit << " -> " << m_limit << ": "
+          << throughput << " jobs/s, cpu " << (uint32_t)(busy * 100) << "% busy, "
+          << (uint32_t)(iowait * 100) << "% iowait");
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cinttypes>
+#include <chrono>
+
+/* Adjusts the number of concurrent jobs while the build runs. Every
+ * window it compares completed jobs per second with the previous window
+ * and looks at CPU use and iowait from /proc/stat:
+ *
+ * - throughput dropped after the last step: step back the other way
+ * - CPU saturated and little iowait: adding jobs cannot help, go down
+ * - CPU idle to spare, or jobs waiting on I/O: go up
+ * - otherwise keep going in the same direction
+ *
+ * Windows in which the limit was not what held jobs back (nothing was
+ * queued) say nothing about it and leave it alone. Only the build loop
+ * calls this. */
+class ParallelismTuner {
+public:
+    ParallelismTuner(uint32_t initial, uint32_t min, uint32_t max);
+
+    uint32_t limit() const { return m_limit; }
+    uint32_t max() const { return m_max; }
+
+    void jobs_finished(uint32_t count) { m_finished += count; }
+    // backlog: jobs were ready but held back by the limit
+    void tick(bool backlog);
+
+    ParallelismTuner(const ParallelismTuner &) =delete;
+    ParallelismTuner& operator=(const ParallelismTuner &) =delete;
+
+private:
+    struct CpuTimes {
+        uint64_t total = 0;
+        uint64_t idle = 0;
+        uint64_t iowait = 0;
+    };
+    static CpuTimes read_cpu_times();
+
+    const uint32_t m_min;
+    const uint32_t m_max;
+    uint32_t m_limit;
+    int m_direction = 1;
+
+    std::chrono::steady_clock::time_point m_window_start;
+    CpuTimes m_window_cpu;
+    uint32_t m_finished = 0;
+    bool m_window_backlog = false;
+    double m_prev_throughput = 0;
+};
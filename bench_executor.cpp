@@ -0,0 +1,90 @@
+#include "executor.h"
+#include "assert.h"
+
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+extern "C" {
+#include <stdlib.h>
+}
+
+// Each task burns a fixed amount of CPU and fans out into children from
+// inside the pool, so the local deques fill unevenly and stealing matters.
+static void spin(uint32_t iterations)
+{
+    volatile uint64_t x = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        x = x * 31 + i;
+    }
+}
+
+struct BenchState {
+    Executor *executor;
+    uint32_t spin_iterations;
+    std::atomic<uint64_t> remaining;
+    std::mutex mtx;
+    std::condition_variable cv;
+};
+
+static void task(BenchState *state, uint32_t depth)
+{
+    spin(state->spin_iterations);
+    if (depth > 0) {
+        for (uint32_t i = 0; i < 4; i++) {
+            state->executor->submit([state, depth]() { task(state, depth - 1); });
+        }
+    }
+    if (--state->remaining == 0) {
+        std::unique_lock<std::mutex> lck (state->mtx);
+        state->cv.notify_all();
+    }
+}
+
+static double run(uint32_t workers, uint32_t roots, uint32_t depth, uint32_t spin_iterations)
+{
+    uint64_t per_root = 0;
+    for (uint32_t d = 0, level = 1; d <= depth; d++, level *= 4) per_root += level;
+
+    Executor executor(workers);
+    BenchState state;
+    state.executor = &executor;
+    state.spin_iterations = spin_iterations;
+    state.remaining = per_root * roots;
+
+    auto before = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < roots; i++) {
+        executor.submit([&state, depth]() { task(&state, depth); });
+    }
+    {
+        std::unique_lock<std::mutex> lck (state.mtx);
+        while (state.remaining > 0) state.cv.wait(lck);
+    }
+    auto after = std::chrono::steady_clock::now();
+    const double secs = std::chrono::duration_cast<std::chrono::microseconds>(after - before).count() / 1e6;
+    return (per_root * roots) / secs;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        std::cerr << "Usage: " << argv[0] << " [max workers]" << std::endl;
+        return 1;
+    }
+    const uint32_t max_workers = (argc == 2) ? atoi(argv[1]) : default_jobs_count();
+    ASSERT(max_workers > 0);
+
+    const uint32_t roots = 64, depth = 5, spin_iterations = 10000;
+    double base = 0;
+    std::cout << "workers\ttasks/s\tspeedup" << std::endl;
+    for (uint32_t workers = 1; ; workers *= 2) {
+        if (workers > max_workers) workers = max_workers;
+        const double rate = run(workers, roots, depth, spin_iterations);
+        if (workers == 1) base = rate;
+        std::cout << workers << "\t" << (uint64_t)rate << "\t" << (rate / base) << std::endl;
+        if (workers == max_workers) break;
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "spawner.h"
+#include "assert.h"
+
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+}
+
+#define SPAWNS 200
+#define IDLE_THREADS 16
+
+// Runs /bin/true again and again, the way jobs used to start and the way
+// they start now, from a process made to look like a master of a growing
+// size: a heap that is all touched, and threads that sit idle.
+static const char *const true_args[] = { "/bin/true", NULL };
+static const char *const no_env[] = { NULL };
+
+static pid_t fork_exec()
+{
+    const pid_t pid = fork();
+    ASSERT(pid >= 0);
+    if (0 == pid) {
+        setpgid(0, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve(true_args[0], (char *const*)true_args, (char *const*)no_env);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t spawn()
+{
+    return spawn_process(true_args[0], true_args, no_env);
+}
+
+static double run(pid_t (*start)())
+{
+    auto before = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < SPAWNS; i++) {
+        const pid_t pid = start();
+        int status;
+        ASSERT(pid == waitpid(pid, &status, 0));
+        ASSERT(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+    }
+    auto after = std::chrono::steady_clock::now();
+    const double secs = std::chrono::duration_cast<std::chrono::microseconds>(after - before).count() / 1e6;
+    return SPAWNS / secs;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        std::cerr << "Usage: " << argv[0] << " [max heap MiB]" << std::endl;
+        return 1;
+    }
+    const uint32_t max_heap_mib = (argc == 2) ? atoi(argv[1]) : 1024;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < IDLE_THREADS; i++) {
+        threads.emplace_back([&]() {
+                std::unique_lock<std::mutex> lck (mtx);
+                while (!done) cv.wait(lck);
+            });
+    }
+
+    std::vector<char *> heap;
+    uint32_t heap_mib = 0;
+    std::cout << "heap MiB\tfork jobs/s\tspawn jobs/s\tspeedup" << std::endl;
+    for (uint32_t target_mib = 0; ; target_mib = (target_mib == 0) ? 64 : target_mib * 2) {
+        if (target_mib > max_heap_mib) target_mib = max_heap_mib;
+        for (; heap_mib < target_mib; heap_mib++) {
+            char *const mib = (char *)malloc(1 << 20);
+            ASSERT(mib);
+            memset(mib, 1, 1 << 20);
+            heap.push_back(mib);
+        }
+        const double fork_rate = run(fork_exec);
+        const double spawn_rate = run(spawn);
+        std::cout << heap_mib << "\t\t" << (uint64_t)fork_rate << "\t\t" << (uint64_t)spawn_rate
+                  << "\t\t" << (spawn_rate / fork_rate) << std::endl;
+        if (target_mib == max_heap_mib) break;
+    }
+
+    for (auto mib : heap) free(mib);
+    {
+        std::unique_lock<std::mutex> lck (mtx);
+        done = true;
+        cv.notify_all();
+    }
+    for (auto &thread : threads) thread.join();
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include "build_graph.h"
+#include "assert.h"
+
+#include <algorithm>
+#include <queue>
+#include <set>
+
+RuleId BuildGraph::add_rule(const BuildRule &rule, const std::vector<TargetId> &outputs, uint64_t duration_us)
+{
+    RuleNode node;
+    node.rule = rule;
+    node.outputs = outputs;
+    node.duration_us = duration_us;
+    node.bottom_level_us = duration_us;
+    m_total_duration_us += duration_us;
+    return m_nodes.push_back(node);
+}
+
+void BuildGraph::set_duration(RuleId id, uint64_t duration_us)
+{
+    RuleNode &node = m_nodes[id];
+    m_total_duration_us -= node.duration_us;
+    m_total_duration_us += duration_us;
+    node.duration_us = duration_us;
+    node.duration_known = true;
+}
+
+std::vector<RuleId> BuildGraph::add_edge(RuleId input, RuleId consumer)
+{
+    std::vector<RuleId> raised;
+    if (input == consumer) return raised;
+    RuleNode &input_node = m_nodes[input];
+    RuleNode &consumer_node = m_nodes[consumer];
+    for (auto c : input_node.consumers) {
+        if (c == consumer) return raised;
+    }
+    input_node.consumers.push_back(consumer);
+    consumer_node.inputs.push_back(input);
+    raise(input, input_node.duration_us + consumer_node.bottom_level_us, raised);
+    return raised;
+}
+
+void BuildGraph::raise(RuleId id, uint64_t bottom_level_us, std::vector<RuleId> &out_raised)
+{
+    std::vector<std::pair<RuleId, uint64_t> > stack;
+    stack.emplace_back(id, bottom_level_us);
+    while (stack.size() > 0) {
+        auto item = stack.back();
+        stack.pop_back();
+        RuleNode &node = m_nodes[item.first];
+        // No simple path is longer than all durations together, so going
+        // past that means we are walking around a dependency cycle
+        const uint64_t level = std::min(item.second, m_total_duration_us);
+        if (level <= node.bottom_level_us) continue;
+        node.bottom_level_us = level;
+        out_raised.push_back(item.first);
+        for (auto input : node.inputs) {
+            stack.emplace_back(input, m_nodes[input].duration_us + level);
+        }
+    }
+}
+
+uint64_t estimate_makespan_us(const BuildGraph &graph, SchedulePolicy policy, uint32_t workers)
+{
+    ASSERT(workers > 0);
+    const uint32_t count = graph.size();
+
+    // Ready rules ordered by policy: (priority, reversed id), largest first
+    typedef std::pair<uint64_t, uint64_t> ReadyKey;
+    std::set<std::pair<ReadyKey, RuleId>, std::greater<std::pair<ReadyKey, RuleId> > > ready;
+    auto make_ready = [&ready, &graph, policy](RuleId id) {
+        const RuleNode &node = graph.node(id);
+        const uint64_t priority = (policy == SchedulePolicy::CriticalPath) ? node.bottom_level_us : 0;
+        ready.insert(std::make_pair(ReadyKey(priority, UINT64_MAX - id), id));
+    };
+
+    std::vector<uint32_t> missing_inputs(count);
+    for (RuleId id = 0; id < count; id++) {
+        missing_inputs[id] = graph.node(id).inputs.size();
+        if (missing_inputs[id] == 0) make_ready(id);
+    }
+
+    typedef std::pair<uint64_t, RuleId> Running; // (finish time, rule)
+    std::priority_queue<Running, std::vector<Running>, std::greater<Running> > running;
+    uint64_t now = 0;
+    uint32_t finished = 0;
+    while (finished < count) {
+        while ((ready.size() > 0) && (running.size() < workers)) {
+            auto best = ready.begin();
+            const RuleId id = best->second;
+            ready.erase(best);
+            running.push(Running(now + graph.node(id).duration_us, id));
+        }
+        if (running.size() == 0) {
+            // Only cycles are left, they would never start
+            DEBUG("Schedule estimate stuck with " << (count - finished) << " rules left");
+            break;
+        }
+        const Running done = running.top();
+        running.pop();
+        now = done.first;
+        finished++;
+        for (auto consumer : graph.node(done.second).consumers) {
+            if (--missing_inputs[consumer] == 0) make_ready(consumer);
+        }
+    }
+    return now;
+}
+
+const JobQueue::QueueKey JobQueue::NOT_QUEUED(0, 0);
+
+// Bottom levels are far below this, so it puts boosted rules first
+#define BOOSTED_PRIORITY (1ULL << 63)
+
+void JobQueue::push(RuleId id, uint64_t priority)
+{
+    if (is_boosted(id)) priority |= BOOSTED_PRIORITY;
+    if (id >= m_keys.size()) m_keys.resize(id + 1, NOT_QUEUED);
+    if (m_keys[id] != NOT_QUEUED) {
+        update(id, priority);
+        return;
+    }
+    const QueueKey key(priority, UINT64_MAX - m_seq++);
+    m_order.insert(std::make_pair(key, id));
+    m_keys[id] = key;
+}
+
+void JobQueue::update(RuleId id, uint64_t priority)
+{
+    if ((id >= m_keys.size()) || (m_keys[id] == NOT_QUEUED)) return;
+    if (is_boosted(id)) priority |= BOOSTED_PRIORITY;
+    const QueueKey old_key = m_keys[id];
+    if (priority <= old_key.first) return;
+    const QueueKey new_key(priority, old_key.second);
+    auto entry = m_order.find(old_key);
+    ASSERT(entry != m_order.end());
+    m_order.erase(entry);
+    m_order.insert(std::make_pair(new_key, id));
+    m_keys[id] = new_key;
+}
+
+bool JobQueue::boost(RuleId id)
+{
+    if (is_boosted(id)) return false;
+    if (id >= m_boosted.size()) m_boosted.resize(id + 1, false);
+    m_boosted[id] = true;
+    if ((id < m_keys.size()) && (m_keys[id] != NOT_QUEUED)) update(id, m_keys[id].first);
+    return true;
+}
+
+RuleId JobQueue::top() const
+{
+    ASSERT(m_order.size() > 0);
+    return m_order.begin()->second;
+}
+
+RuleId JobQueue::pop()
+{
+    ASSERT(m_order.size() > 0);
+    auto best = m_order.begin();
+    const RuleId id = best->second;
+    m_order.erase(best);
+    m_keys[id] = NOT_QUEUED;
+    return id;
+}
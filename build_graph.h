@@ -0,0 +1,136 @@
+#pragma once
+
+#include "build_rules.h"
+#include "dense_array.h"
+#include "symbol_table.h"
+#include "admission.h"
+
+#include <cinttypes>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <map>
+
+class Job;
+
+typedef uint32_t RuleId;
+#define NO_RULE ((RuleId)-1)
+
+enum class SchedulePolicy {
+    Fifo,
+    CriticalPath,
+};
+
+enum class RuleState {
+    Idle,
+    Running,
+    Done,
+    Failed,
+};
+
+/* Everything known about one rule. Each rule is stored exactly once, and
+ * everything else refers to it by RuleId. */
+struct RuleNode {
+    BuildRule rule;
+    std::vector<TargetId> outputs;
+
+    uint64_t duration_us = 0;
+    bool duration_known = false; // measured, rather than a guess
+    uint64_t bottom_level_us = 0;
+    ResourceDemand demand;
+    std::vector<RuleId> inputs;
+    std::vector<RuleId> consumers;
+    // Inputs the rule wanted in the previous build, prebuilt ahead of it
+    std::vector<TargetId> learned_inputs;
+
+    // The fields below are guarded by the rule's lock in the runner
+    RuleState state = RuleState::Idle;
+    // Set as soon as the rule is known to fail, which may be while it runs
+    bool failed = false;
+    Job *job = nullptr;
+    // Continuations of jobs blocked on this rule, fired when it is done or failed
+    std::vector<std::function<void(void)> > waiters;
+    // With early outputs: the outputs the running job closed so far, and
+    // continuations of jobs blocked on one output, fired when it is closed
+    // or else with the waiters
+    std::vector<TargetId> closed_outputs;
+    std::vector<std::pair<TargetId, std::function<void(void)> > > output_waiters;
+    // Generated inputs this rule's job wanted so far
+    std::vector<TargetId> wanted;
+    // Resource use of the finished job, 0 if not measured
+    uint64_t peak_rss_kb = 0;
+    uint64_t cpu_us = 0;
+
+    // Guarded by the runner's blocking lock: while any of the job's wants
+    // waits for an input, the job gives up its execution token
+    uint32_t blocked_wants = 0;
+    bool holds_token = false;
+    // Admitted for the job along with its token: its own demand, or the
+    // first rule's for a batch
+    uint32_t admitted_cores_milli = 0;
+    std::chrono::steady_clock::time_point blocked_since;
+    uint64_t blocked_us = 0;
+    std::chrono::steady_clock::time_point started_at;
+    // (time run so far, not counting blocked time, wanted rule) of every
+    // want that resolved to a rule, for the build trace
+    std::vector<std::pair<uint64_t, RuleId> > want_points;
+
+    // Guarded by the runner's wait-for graph lock: the rules this job's
+    // blocked wants are waiting for, and the targets they asked for
+    std::vector<std::pair<RuleId, TargetId> > waiting_on;
+};
+
+/* The rule graph as resolved so far, as a dense array of RuleNodes in
+ * resolve order. Edges run from a rule to the rules consuming its
+ * outputs. Each node keeps its bottom level: its own duration plus the
+ * longest chain of consumers after it, i.e. how much of the build is
+ * still waiting on it once it starts. Bottom levels are kept up to date
+ * as edges appear. */
+class BuildGraph {
+public:
+    RuleId add_rule(const BuildRule &rule, const std::vector<TargetId> &outputs, uint64_t duration_us);
+    // Returns the rules whose bottom level rose as a result
+    std::vector<RuleId> add_edge(RuleId input, RuleId consumer);
+    void set_duration(RuleId id, uint64_t duration_us);
+
+    RuleNode &node(RuleId id) { return m_nodes[id]; }
+    const RuleNode &node(RuleId id) const { return m_nodes[id]; }
+    uint32_t size() const { return m_nodes.size(); }
+
+private:
+    void raise(RuleId id, uint64_t bottom_level_us, std::vector<RuleId> &out_raised);
+
+    DenseArray<RuleNode> m_nodes;
+    uint64_t m_total_duration_us = 0;
+};
+
+/* List-schedules the graph on the given number of workers, starting a
+ * rule only once all its inputs are done, and returns the makespan. */
+uint64_t estimate_makespan_us(const BuildGraph &graph, SchedulePolicy policy, uint32_t workers);
+
+/* Rules waiting to be dispatched, highest priority first, FIFO among
+ * equals. Pushing a rule that is already queued only raises its priority.
+ * Boosted rules, ones a running job is waiting for, go ahead of all
+ * others whether they are queued yet or not. */
+class JobQueue {
+public:
+    void push(RuleId id, uint64_t priority);
+    void update(RuleId id, uint64_t priority);
+    // Returns false if the rule was boosted already
+    bool boost(RuleId id);
+    bool is_boosted(RuleId id) const { return (id < m_boosted.size()) && m_boosted[id]; }
+    RuleId top() const;
+    RuleId pop();
+    std::size_t size() const { return m_order.size(); }
+
+private:
+    // (priority, reversed sequence), largest first
+    typedef std::pair<uint64_t, uint64_t> QueueKey;
+    static const QueueKey NOT_QUEUED;
+
+    std::map<QueueKey, RuleId, std::greater<QueueKey> > m_order;
+    std::vector<QueueKey> m_keys; // indexed by RuleId
+    std::vector<bool> m_boosted; // indexed by RuleId
+    uint64_t m_seq = 0;
+};
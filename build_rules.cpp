@@ -11,6 +11,7 @@ extern "C" {
 #include <string.h>
 }
 
+#define EARLY_OUTPUTS_DIRECTIVE "# buildsome: early-outputs"
 
 BuildRules::BuildRules(std::string query_program)
 {
@@ -104,6 +105,9 @@ Optional<BuildRule> BuildRules::query(std::string output) const
     BuildRule result;
     DEBUG("read commands");
     result.commands = read_multi_line(m_pipefd_to_parent[0]);
+    for (auto &command : result.commands) {
+        if (command == EARLY_OUTPUTS_DIRECTIVE) result.early_outputs = true;
+    }
     DEBUG("read inputs");
     result.inputs = read_multi_line(m_pipefd_to_parent[0]);
     DEBUG("read outputs");
@@ -9,10 +9,10 @@ struct BuildRule {
     std::vector<std::string> inputs;
     std::vector<std::string> outputs;
     std::vector<std::string> commands;
-
-    bool operator<(const BuildRule &other) const {
-        return (outputs < other.outputs);
-    }
+    // Set by a "# buildsome: early-outputs" line among the commands: each
+    // output is final once the commands close it, and whoever waits for
+    // it may go on before the rest of the rule is done
+    bool early_outputs = false;
 
     std::string to_string() const {
         ASSERT(outputs.size() > 0);
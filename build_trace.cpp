@@ -0,0 +1,91 @@
+#include "build_trace.h"
+#include "assert.h"
+
+#include <fstream>
+
+extern "C" {
+#include <stdio.h>
+#include <stdlib.h>
+}
+
+bool BuildTrace::load(const std::string &path)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) return false;
+    jobs = 0;
+    makespan_us = 0;
+    rules.clear();
+    TraceRule *current = nullptr;
+    std::string line;
+    while (std::getline(file, line)) {
+        const std::size_t tab = line.find('\t');
+        if (tab == std::string::npos) continue;
+        const std::string key = line.substr(0, tab);
+        const std::string value = line.substr(tab + 1);
+        if (key == "jobs") {
+            jobs = strtoul(value.c_str(), nullptr, 10);
+            continue;
+        }
+        if (key == "makespan_us") {
+            makespan_us = strtoull(value.c_str(), nullptr, 10);
+            continue;
+        }
+        if (key == "rule") {
+            rules.emplace_back();
+            current = &rules.back();
+            current->name = value;
+            continue;
+        }
+        if (!current) continue;
+        if (key == "duration_us") {
+            current->duration_us = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "peak_rss_kb") {
+            current->peak_rss_kb = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "cpu_us") {
+            current->cpu_us = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "input") {
+            current->inputs.push_back(strtoul(value.c_str(), nullptr, 10));
+        } else if (key == "want") {
+            char *rule_str;
+            const uint64_t offset_us = strtoull(value.c_str(), &rule_str, 10);
+            current->wants.emplace_back(offset_us, strtoul(rule_str, nullptr, 10));
+        }
+    }
+    // Drop references to rules the trace does not have
+    for (auto &rule : rules) {
+        for (auto it = rule.inputs.begin(); it != rule.inputs.end(); ) {
+            it = (*it < rules.size()) ? (it + 1) : rule.inputs.erase(it);
+        }
+        for (auto it = rule.wants.begin(); it != rule.wants.end(); ) {
+            it = (it->second < rules.size()) ? (it + 1) : rule.wants.erase(it);
+        }
+    }
+    return true;
+}
+
+void BuildTrace::save(const std::string &path) const
+{
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        if (!file.is_open()) {
+            PRINT("Failed to write build trace: " << tmp_path);
+            return;
+        }
+        file << "jobs\t" << jobs << "\n";
+        file << "makespan_us\t" << makespan_us << "\n";
+        for (auto &rule : rules) {
+            file << "rule\t" << rule.name << "\n";
+            file << "duration_us\t" << rule.duration_us << "\n";
+            file << "peak_rss_kb\t" << rule.peak_rss_kb << "\n";
+            file << "cpu_us\t" << rule.cpu_us << "\n";
+            for (auto input : rule.inputs) {
+                file << "input\t" << input << "\n";
+            }
+            for (auto &want : rule.wants) {
+                file << "want\t" << want.first << " " << want.second << "\n";
+            }
+        }
+    }
+    ASSERT(0 == rename(tmp_path.c_str(), path.c_str()));
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <utility>
+
+/* One rule of a recorded build. Rules refer to each other by their index
+ * in the trace, which is the order they were resolved in. */
+struct TraceRule {
+    std::string name; // first output
+    uint64_t duration_us = 0; // not counting time blocked on inputs
+    uint64_t peak_rss_kb = 0; // 0 if not measured
+    uint64_t cpu_us = 0;
+    // Rules whose outputs this one declared, or wanted in an earlier build
+    std::vector<uint32_t> inputs;
+    // (offset into duration_us, rule) for every generated input the
+    // commands asked for through the hook, in order
+    std::vector<std::pair<uint64_t, uint32_t> > wants;
+};
+
+/* A build as the scheduler saw it, for replaying it offline. Persisted
+ * in the same "key<TAB>value" format as the job stats. */
+struct BuildTrace {
+    uint32_t jobs = 0; // the job limit at the end of the build
+    uint64_t makespan_us = 0; // as measured
+    std::vector<TraceRule> rules;
+
+    bool load(const std::string &path);
+    void save(const std::string &path) const;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "assert.h"
+
+#include <cinttypes>
+#include <atomic>
+#include <thread>
+
+/* An append-only array of T indexed by dense integer IDs. Storage is
+ * allocated in fixed chunks that never move, so references stay valid
+ * while the array grows. Neither appending nor indexing takes a lock; an
+ * ID must only be handed to other threads after the append that created
+ * it has returned. size() only counts elements that are fully written:
+ * appends publish their slots in index order. */
+template <typename T, uint32_t CHUNK_BITS = 12, uint32_t MAX_CHUNKS = (1 << 16)> class DenseArray
+{
+private:
+    static constexpr const uint32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+
+    std::atomic<T *> m_chunks[MAX_CHUNKS];
+    std::atomic<uint32_t> m_reserved; // slots handed out to appenders
+    std::atomic<uint32_t> m_published; // slots written, in order
+
+public:
+    DenseArray() : m_reserved(0), m_published(0) {
+        for (auto &chunk : m_chunks) chunk = nullptr;
+    }
+
+    ~DenseArray() {
+        for (auto &chunk : m_chunks) delete[] chunk.load();
+    }
+
+    DenseArray(const DenseArray &) =delete;
+    DenseArray& operator=(const DenseArray &) =delete;
+
+    uint32_t push_back(const T &value) {
+        const uint32_t idx = m_reserved++;
+        const uint32_t chunk_idx = idx >> CHUNK_BITS;
+        ASSERT(chunk_idx < MAX_CHUNKS);
+        T *chunk = m_chunks[chunk_idx];
+        if (chunk == nullptr) {
+            // Racing appenders may both allocate; the loser frees its copy
+            T *fresh = new T[CHUNK_SIZE];
+            if (m_chunks[chunk_idx].compare_exchange_strong(chunk, fresh)) {
+                chunk = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        chunk[idx & (CHUNK_SIZE - 1)] = value;
+        // Appends racing for earlier slots publish theirs first
+        while (m_published.load(std::memory_order_acquire) != idx) std::this_thread::yield();
+        m_published.store(idx + 1, std::memory_order_release);
+        return idx;
+    }
+
+    T &operator[](uint32_t idx) {
+        ASSERT(idx < m_published.load(std::memory_order_acquire));
+        return m_chunks[idx >> CHUNK_BITS][idx & (CHUNK_SIZE - 1)];
+    }
+
+    const T &operator[](uint32_t idx) const {
+        ASSERT(idx < m_published.load(std::memory_order_acquire));
+        return m_chunks[idx >> CHUNK_BITS][idx & (CHUNK_SIZE - 1)];
+    }
+
+    uint32_t size() const { return m_published.load(std::memory_order_acquire); }
+};
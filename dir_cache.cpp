@@ -0,0 +1,83 @@
+#include "dir_cache.h"
+#include "assert.h"
+
+extern "C" {
+#include <sys/stat.h>
+#include <errno.h>
+}
+
+static bool is_under(const std::string &path, const std::string &dir)
+{
+    return (path.size() > dir.size()) && (path[dir.size()] == '/') && (0 == path.compare(0, dir.size(), dir));
+}
+
+bool DirCache::exists(const std::string &dir)
+{
+    m_lookups++;
+    bool changing;
+    uint64_t generation;
+    {
+        std::unique_lock<std::mutex> lck (m_mtx);
+        changing = is_changing(dir);
+        if (!changing) {
+            auto found = m_exists.find(dir);
+            if (found != m_exists.end()) {
+                m_hits++;
+                return found->second;
+            }
+        }
+        generation = m_generation;
+    }
+
+    struct stat dir_stat;
+    const bool dir_exists = (0 == stat(dir.c_str(), &dir_stat));
+    if (!dir_exists) ASSERT((ENOENT == errno) || (ENOTDIR == errno));
+
+    std::unique_lock<std::mutex> lck (m_mtx);
+    if (!changing && (generation == m_generation)) m_exists[dir] = dir_exists;
+    return dir_exists;
+}
+
+// The directory itself or one it is in
+bool DirCache::is_changing(const std::string &dir) const
+{
+    if (m_changing.size() == 0) return false;
+    for (std::size_t end = dir.size(); end != std::string::npos; end = dir.rfind('/', end - 1)) {
+        if (m_changing.find(dir.substr(0, end)) != m_changing.end()) return true;
+        if (end == 0) break;
+    }
+    return false;
+}
+
+void DirCache::begin_changing(const std::string &path)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    m_changing[path]++;
+    forget_locked(path);
+}
+
+void DirCache::end_changing(const std::string &path)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    auto found = m_changing.find(path);
+    ASSERT(found != m_changing.end());
+    if (--found->second == 0) m_changing.erase(found);
+    forget_locked(path);
+}
+
+void DirCache::forget(const std::string &path)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    forget_locked(path);
+}
+
+void DirCache::forget_locked(const std::string &path)
+{
+    m_generation++;
+    m_exists.erase(path);
+    // Everything under it sorts right after path + "/"
+    auto it = m_exists.lower_bound(path + "/");
+    while ((it != m_exists.end()) && is_under(it->first, path)) {
+        it = m_exists.erase(it);
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+/* Whether directories under the build root exist, as the master last saw
+ * them. Commands ask about the directory of every output they write, and
+ * most of those are the same few directories, so each is stat'ed once and
+ * then answered from here.
+ *
+ * The master learns of changes under the root from the hook, which
+ * reports mkdir/mkdirat, rmdir, rename/renameat/renameat2 and
+ * unlink/unlinkat before they happen, and outputs change when a rule
+ * starts and when it is done. A path some running job may remove or
+ * move is stat'ed on every lookup until that job is done; a path that
+ * changed is forgotten, along with everything under it.
+ *
+ * A change the hook does not see, such as one made by a statically
+ * linked command, through a raw syscall or by a process outside the
+ * build, can make an answer stale. One that wrongly says missing only
+ * costs a want that finds nothing to build; one that wrongly says a
+ * directory exists skips the want for it, so a rule that generates it
+ * is not run first and is not recorded as a dependency. */
+class DirCache {
+public:
+    DirCache() : m_lookups(0), m_hits(0) { }
+
+    bool exists(const std::string &dir);
+    // A running job may remove or move the path from now on
+    void begin_changing(const std::string &path);
+    // ... and now it is done
+    void end_changing(const std::string &path);
+    // The path, or something under it, changed
+    void forget(const std::string &path);
+
+    uint64_t lookups() const { return m_lookups; }
+    // Lookups answered without a stat
+    uint64_t hits() const { return m_hits; }
+
+    DirCache(const DirCache &) =delete;
+    DirCache& operator=(const DirCache &) =delete;
+
+private:
+    bool is_changing(const std::string &dir) const;
+    void forget_locked(const std::string &path);
+
+    std::mutex m_mtx;
+    std::map<std::string, bool> m_exists;
+    std::map<std::string, uint32_t> m_changing; // by how many jobs
+    // Bumped on every change, so a stat that raced with one is not kept
+    uint64_t m_generation = 0;
+    std::atomic<uint64_t> m_lookups;
+    std::atomic<uint64_t> m_hits;
+};
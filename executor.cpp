@@ -0,0 +1,169 @@
+#include "executor.h"
+#include "assert.h"
+
+#include <chrono>
+
+static __thread Executor *current_executor = nullptr;
+static __thread uint32_t current_worker_idx = 0;
+
+Executor::Executor(uint32_t workers_count)
+    : m_next_worker(0)
+    , m_pending(0)
+    , m_spares_started(0)
+    , m_stopping(false)
+    , m_blocked(0)
+    , m_spares_busy(0)
+{
+    ASSERT(workers_count > 0);
+    for (uint32_t i = 0; i < workers_count; i++) {
+        m_workers.push_back(new Worker());
+    }
+    for (uint32_t i = 0; i < workers_count; i++) {
+        m_workers[i]->thread = new std::thread(&Executor::worker_main, this, i);
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        TIMEIT(std::unique_lock<std::mutex> lck (m_idle_mtx));
+        m_stopping = true;
+        m_idle_cv.notify_all();
+        m_spare_cv.notify_all();
+    }
+    for (auto spare : m_spares) {
+        spare->join();
+        delete spare;
+    }
+    for (auto worker : m_workers) {
+        worker->thread->join();
+        delete worker->thread;
+        DEBUG("worker executed: " << worker->executed << " stolen: " << worker->stolen);
+        delete worker;
+    }
+}
+
+void Executor::submit(std::function<void(void)> task)
+{
+    uint32_t idx;
+    const bool local = (current_executor == this);
+    if (local) {
+        idx = current_worker_idx;
+    } else {
+        idx = m_next_worker++ % m_workers.size();
+    }
+    // Counted before the push so a worker can never see the task without the count
+    m_pending++;
+    {
+        Worker &worker = *m_workers[idx];
+        TIMEIT(std::unique_lock<std::mutex> lck (worker.mtx));
+        if (local) {
+            worker.tasks.push_back(task);
+        } else {
+            worker.tasks.push_front(task);
+        }
+    }
+    TIMEIT(std::unique_lock<std::mutex> lck (m_idle_mtx));
+    m_idle_cv.notify_one();
+    if (m_spares_busy < m_blocked) m_spare_cv.notify_one();
+}
+
+void Executor::begin_blocking()
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_idle_mtx));
+    m_blocked++;
+    if (m_spares.size() < m_blocked) {
+        m_spares_started++;
+        m_spares.push_back(new std::thread(&Executor::spare_main, this));
+    }
+    // A parked spare may take pending work now
+    m_spare_cv.notify_one();
+}
+
+void Executor::end_blocking()
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_idle_mtx));
+    ASSERT(m_blocked > 0);
+    m_blocked--;
+}
+
+bool Executor::try_pop(uint32_t idx, std::function<void(void)> &out_task)
+{
+    Worker &worker = *m_workers[idx];
+    TIMEIT(std::unique_lock<std::mutex> lck (worker.mtx));
+    if (worker.tasks.size() == 0) return false;
+    out_task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+    return true;
+}
+
+bool Executor::try_steal(uint32_t idx, std::function<void(void)> &out_task)
+{
+    const uint32_t count = m_workers.size();
+    // Spares own no deque and pass idx == count, so they try every worker
+    for (uint32_t i = (idx < count) ? 1 : 0; i < count; i++) {
+        Worker &victim = *m_workers[(idx + i) % count];
+        TIMEIT(std::unique_lock<std::mutex> lck (victim.mtx));
+        if (victim.tasks.size() == 0) continue;
+        out_task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+    }
+    return false;
+}
+
+void Executor::worker_main(uint32_t idx)
+{
+    current_executor = this;
+    current_worker_idx = idx;
+    Worker &self = *m_workers[idx];
+    while (true) {
+        std::function<void(void)> task;
+        if (try_pop(idx, task)) {
+            self.executed++;
+        } else if (try_steal(idx, task)) {
+            self.executed++;
+            self.stolen++;
+        } else {
+            TIMEIT(std::unique_lock<std::mutex> lck (m_idle_mtx));
+            while (m_pending == 0) {
+                if (m_stopping) return;
+                m_idle_cv.wait(lck);
+            }
+            continue;
+        }
+        m_pending--;
+        task();
+    }
+}
+
+void Executor::spare_main()
+{
+    while (true) {
+        {
+            TIMEIT(std::unique_lock<std::mutex> lck (m_idle_mtx));
+            while (true) {
+                if (m_stopping) return;
+                if ((m_pending > 0) && (m_spares_busy < m_blocked)) break;
+                m_spare_cv.wait(lck);
+            }
+            m_spares_busy++;
+        }
+        std::function<void(void)> task;
+        const bool stolen = try_steal(m_workers.size(), task);
+        if (stolen) {
+            m_pending--;
+            task();
+        }
+        TIMEIT(std::unique_lock<std::mutex> lck (m_idle_mtx));
+        m_spares_busy--;
+        // Another spare may have been held back by this one
+        if (m_pending > 0) m_spare_cv.notify_one();
+    }
+}
+
+uint32_t default_jobs_count()
+{
+    const uint32_t cores = std::thread::hardware_concurrency();
+    return (cores > 0) ? cores : 1;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cinttypes>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/* A fixed set of worker threads, each with its own task deque. A worker
+ * pops its own deque LIFO and, when empty, steals FIFO from the others.
+ * Tasks submitted from outside the pool are spread round-robin.
+ *
+ * A task that has to wait for other tasks brackets the wait with
+ * begin_blocking()/end_blocking(). While it is blocked a spare worker
+ * (which only steals) keeps the pool at full strength, so a wait can
+ * never starve the work it is waiting for. Spares park once they are
+ * not needed and stand in for the next blocked task, so there are never
+ * more of them than tasks were blocked at once. */
+class Executor {
+public:
+    explicit Executor(uint32_t workers_count);
+    ~Executor();
+
+    void submit(std::function<void(void)> task);
+    uint32_t workers_count() const { return (uint32_t)m_workers.size(); }
+
+    void begin_blocking();
+    void end_blocking();
+    // Threads started to stand in for blocked tasks
+    uint64_t spares_started() const { return m_spares_started; }
+
+    Executor(const Executor &) =delete;
+    Executor& operator=(const Executor &) =delete;
+
+private:
+    struct Worker {
+        std::deque<std::function<void(void)> > tasks;
+        std::mutex mtx;
+        std::thread *thread;
+        uint64_t executed = 0;
+        uint64_t stolen = 0;
+    };
+
+    void worker_main(uint32_t idx);
+    void spare_main();
+    bool try_pop(uint32_t idx, std::function<void(void)> &out_task);
+    bool try_steal(uint32_t idx, std::function<void(void)> &out_task);
+
+    std::vector<Worker *> m_workers;
+    std::atomic<uint32_t> m_next_worker;
+    std::atomic<uint64_t> m_pending;
+    std::atomic<uint64_t> m_spares_started;
+
+    std::mutex m_idle_mtx;
+    std::condition_variable m_idle_cv;
+    // Parked spares wait apart, so that waking them never takes the
+    // place of waking a worker
+    std::condition_variable m_spare_cv;
+    bool m_stopping;
+
+    // Guarded by m_idle_mtx
+    uint32_t m_blocked;
+    uint32_t m_spares_busy; // running a task, at most m_blocked at a time
+    std::vector<std::thread *> m_spares;
+};
+
+uint32_t default_jobs_count();
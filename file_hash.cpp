@@ -0,0 +1,54 @@
+#include "file_hash.h"
+
+#include <vector>
+#include <algorithm>
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <bsd/md5.h>
+}
+
+// The names in the directory and what each is, in a stable order: a
+// command that lists it sees a change only when one of these changes
+static std::string dir_hash(const std::string &path)
+{
+    DIR *const dir = opendir(path.c_str());
+    if (dir == nullptr) return UNREADABLE_HASH;
+    std::vector<std::string> entries;
+    while (struct dirent *entry = readdir(dir)) {
+        if ((0 == strcmp(entry->d_name, ".")) || (0 == strcmp(entry->d_name, ".."))) continue;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat entry_stat;
+            const std::string entry_path = path + "/" + entry->d_name;
+            type = (0 == lstat(entry_path.c_str(), &entry_stat)) ? (unsigned char)IFTODT(entry_stat.st_mode) : (unsigned char)DT_UNKNOWN;
+        }
+        entries.push_back(std::string(entry->d_name) + " " + std::to_string(type) + "\n");
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end());
+    std::string listing;
+    for (auto &entry : entries) listing += entry;
+    return "dir:" + data_hash(listing);
+}
+
+std::string file_hash(const std::string &path)
+{
+    struct stat stat_buf;
+    if (0 != stat(path.c_str(), &stat_buf)) return "-";
+    if (S_ISDIR(stat_buf.st_mode)) return dir_hash(path);
+    char md5[MD5_DIGEST_STRING_LENGTH];
+    if (!MD5File(path.c_str(), md5)) return UNREADABLE_HASH;
+    return md5;
+}
+
+std::string data_hash(const std::string &data)
+{
+    char md5[MD5_DIGEST_STRING_LENGTH];
+    MD5Data(reinterpret_cast<const unsigned char *>(data.data()), data.size(), md5);
+    return md5;
+}
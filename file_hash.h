@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+/* Content hashes, for telling whether a rule's inputs or outputs changed
+ * since the previous build */
+
+// What file_hash returns for a path it cannot read. Nothing is known of
+// its content, so it never counts as unchanged.
+#define UNREADABLE_HASH "?"
+
+// MD5 of the file's content, or of the names and types of the entries
+// of a directory, "-" if there is nothing at path and UNREADABLE_HASH if
+// it cannot be read
+std::string file_hash(const std::string &path);
+std::string data_hash(const std::string &data);
@@ -1,6 +1,7 @@
 #include "client.h"
 
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -51,10 +52,17 @@ static int connect_master(const char *need_str)
     struct sockaddr_un addr = {
         .sun_family = AF_UNIX,
     };
-    ASSERT(strlen(env_sockaddr) < sizeof addr.sun_path);
+    size_t sockaddr_len = strlen(env_sockaddr);
+    ASSERT(sockaddr_len < sizeof addr.sun_path);
     strcpy(addr.sun_path, env_sockaddr);
+    socklen_t addr_len = sizeof addr;
+    if(addr.sun_path[0] == '@') {
+        /* Abstract address: the @ stands for a NUL, and no NUL ends it */
+        addr.sun_path[0] = 0;
+        addr_len = offsetof(struct sockaddr_un, sun_path) + sockaddr_len;
+    }
 
-    int connect_rc = connect(fd, (struct sockaddr*) &addr, sizeof addr);
+    int connect_rc = connect(fd, (struct sockaddr*) &addr, addr_len);
     if(0 != connect_rc) {
         close(fd);
         return -1;
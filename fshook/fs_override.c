@@ -29,7 +29,8 @@ static struct {
     char cwd[MAX_PATH];
     unsigned root_filter_length;
     char root_filter[MAX_PATH];
-} process_state = {-1U, "", -1U, ""};
+    bool report_closes;
+} process_state = {-1U, "", -1U, "", false};
 
 static void update_cwd(void)
 {
@@ -63,6 +64,10 @@ static void initialize_process_state(void)
     ASSERT(len < sizeof process_state.root_filter);
     process_state.root_filter[len] = 0;
     process_state.root_filter_length = len;
+
+    /* Only rules with early outputs have a use for the close reports */
+    const char *report_closes = getenv(ENVVARS_PREFIX "REPORT_CLOSES");
+    process_state.report_closes = report_closes && !strcmp(report_closes, "1");
 }
 
 static void send_connection_await(const char *buf, size_t size, bool is_delayed)
@@ -164,6 +169,64 @@ static bool try_chop_common_root(unsigned prefix_length, char *prefix, char *can
 #define OUT_EFFECT_IF_NOT_ERROR(err_val, effect)        \
             ((err_val) == result) ? OUT_EFFECT_NOTHING : (effect)
 
+/* In-root paths opened for writing, by fd, so that closing the last fd
+ * a path was written through can be reported. That lets the master hand
+ * a finished output to its consumers before the rest of the rule is
+ * done. Duplicates made by dup/dup2/dup3 are followed; ones made by
+ * fcntl(F_DUPFD) and fds passed on to children are not, so a rule
+ * doing that should not rely on the report. A forked child starts with
+ * an empty table: the parent may still write through the fds it closes.
+ * Tracked only when the master asked for the reports. */
+#define MAX_WRITTEN_FDS 1024
+static char *written_paths[MAX_WRITTEN_FDS];
+
+static void forget_written_fds(void)
+{
+    for(unsigned i = 0; i < MAX_WRITTEN_FDS; i++) {
+        free(__atomic_exchange_n(&written_paths[i], NULL, __ATOMIC_ACQ_REL));
+    }
+}
+
+static void __attribute__((constructor)) register_fork_handler(void)
+{
+    pthread_atfork(NULL, NULL, forget_written_fds);
+}
+
+static void track_written_fd(int fd, const char *path)
+{
+    if(fd < 0 || fd >= MAX_WRITTEN_FDS) return;
+    if(!process_state.report_closes) return;
+    char *old = __atomic_exchange_n(&written_paths[fd], strdup(path), __ATOMIC_ACQ_REL);
+    free(old);
+}
+
+static void report_closed_fd(int fd)
+{
+    if(fd < 0 || fd >= MAX_WRITTEN_FDS) return;
+    char *path = __atomic_exchange_n(&written_paths[fd], NULL, __ATOMIC_ACQ_REL);
+    if(!path) return;
+    bool still_open = false;
+    for(unsigned i = 0; i < MAX_WRITTEN_FDS && !still_open; i++) {
+        const char *other = __atomic_load_n(&written_paths[i], __ATOMIC_ACQUIRE);
+        still_open = other && !strcmp(other, path);
+    }
+    if(!still_open) {
+        DEFINE_MSG(msg, close);
+        struct writer path_writer = { PS(msg.args.path.out_path) };
+        writer_append_str(&path_writer, path);
+        msg.args.path.out_effect = OUT_EFFECT_UNKNOWN;
+        bool ATTR_UNUSED res = client__send_hooked(false, PS(msg));
+    }
+    free(path);
+}
+
+static void dup_written_fd(int oldfd, int newfd)
+{
+    if(oldfd < 0 || oldfd >= MAX_WRITTEN_FDS) return;
+    const char *path = __atomic_load_n(&written_paths[oldfd], __ATOMIC_ACQUIRE);
+    if(path) track_written_fd(newfd, path);
+}
+
 DEFINE_WRAPPER(int, creat, (const char *path, mode_t mode))
 {
     initialize_process_state();
@@ -172,7 +235,7 @@ DEFINE_WRAPPER(int, creat, (const char *path, mode_t mode))
     OUT_PATH_COPY(needs_await, msg.args.path, path);
     msg.args.mode = mode;
 
-    return CALL_WITH_OUTPUTS(
+    int fd = CALL_WITH_OUTPUTS(
         msg, needs_await,
         int, (creat, path, mode),
         {
@@ -181,6 +244,52 @@ DEFINE_WRAPPER(int, creat, (const char *path, mode_t mode))
             msg.args.path.out_effect =
                 OUT_EFFECT_IF_NOT_ERROR(-1, OUT_EFFECT_CREATED);
         });
+    if(needs_await) track_written_fd(fd, msg.args.path.out_path);
+    return fd;
+}
+
+DEFINE_WRAPPER(int, close, (int fd))
+{
+    /* The fd is gone even if this fails */
+    int result = SILENT_CALL_REAL(close, fd);
+    report_closed_fd(fd);
+    return result;
+}
+
+DEFINE_WRAPPER(int, fclose, (FILE *stream))
+{
+    int fd = fileno(stream);
+    int result = SILENT_CALL_REAL(fclose, stream);
+    report_closed_fd(fd);
+    return result;
+}
+
+DEFINE_WRAPPER(int, dup, (int oldfd))
+{
+    int result = SILENT_CALL_REAL(dup, oldfd);
+    dup_written_fd(oldfd, result);
+    return result;
+}
+
+/* Replacing newfd closes what it referred to */
+DEFINE_WRAPPER(int, dup2, (int oldfd, int newfd))
+{
+    int result = SILENT_CALL_REAL(dup2, oldfd, newfd);
+    if(result >= 0 && oldfd != newfd) {
+        report_closed_fd(newfd);
+        dup_written_fd(oldfd, newfd);
+    }
+    return result;
+}
+
+DEFINE_WRAPPER(int, dup3, (int oldfd, int newfd, int flags))
+{
+    int result = SILENT_CALL_REAL(dup3, oldfd, newfd, flags);
+    if(result >= 0) {
+        report_closed_fd(newfd);
+        dup_written_fd(oldfd, newfd);
+    }
+    return result;
 }
 
 /* Depends on the full path */
@@ -334,6 +443,63 @@ DEFINE_WRAPPER(int, rename, (const char *oldpath, const char *newpath))
         });
 }
 
+/* Outputs both full paths */
+DEFINE_WRAPPER(int, renameat, (int olddirfd, const char *oldpath, int newdirfd, const char *newpath))
+{
+    char oldfullpath[MAX_PATH], newfullpath[MAX_PATH];
+    const char *oldpathptr = oldpath, *newpathptr = newpath;
+    initialize_process_state();
+    if (AT_FDCWD != olddirfd && oldpath[0] != '/') {
+        if (!get_fullpath_of_dirfd(PS(oldfullpath), olddirfd, oldpath)) return -1;
+        oldpathptr = oldfullpath;
+    }
+    if (AT_FDCWD != newdirfd && newpath[0] != '/') {
+        if (!get_fullpath_of_dirfd(PS(newfullpath), newdirfd, newpath)) return -1;
+        newpathptr = newfullpath;
+    }
+    TRACE_DEBUG("renameat %d, %s, %d, %s -> %s, %s", olddirfd, oldpath, newdirfd, newpath, oldpathptr, newpathptr);
+    bool needs_await = false;
+    DEFINE_MSG(msg, rename);
+    OUT_PATH_COPY(needs_await, msg.args.oldpath, oldpathptr);
+    OUT_PATH_COPY(needs_await, msg.args.newpath, newpathptr);
+    return CALL_WITH_OUTPUTS(
+        msg, needs_await,
+        int, (renameat, olddirfd, oldpath, newdirfd, newpath),
+        {
+            msg.args.oldpath.out_effect = OUT_EFFECT_IF_NOT_ERROR(-1, OUT_EFFECT_DELETED);
+            msg.args.newpath.out_effect = OUT_EFFECT_IF_NOT_ERROR(-1, OUT_EFFECT_CHANGED);
+        });
+}
+
+/* Outputs both full paths. With RENAME_EXCHANGE, neither goes away. */
+DEFINE_WRAPPER(int, renameat2, (int olddirfd, const char *oldpath, int newdirfd, const char *newpath, unsigned int flags))
+{
+    char oldfullpath[MAX_PATH], newfullpath[MAX_PATH];
+    const char *oldpathptr = oldpath, *newpathptr = newpath;
+    initialize_process_state();
+    if (AT_FDCWD != olddirfd && oldpath[0] != '/') {
+        if (!get_fullpath_of_dirfd(PS(oldfullpath), olddirfd, oldpath)) return -1;
+        oldpathptr = oldfullpath;
+    }
+    if (AT_FDCWD != newdirfd && newpath[0] != '/') {
+        if (!get_fullpath_of_dirfd(PS(newfullpath), newdirfd, newpath)) return -1;
+        newpathptr = newfullpath;
+    }
+    TRACE_DEBUG("renameat2 %d, %s, %d, %s, %X -> %s, %s", olddirfd, oldpath, newdirfd, newpath, flags, oldpathptr, newpathptr);
+    bool needs_await = false;
+    DEFINE_MSG(msg, rename);
+    OUT_PATH_COPY(needs_await, msg.args.oldpath, oldpathptr);
+    OUT_PATH_COPY(needs_await, msg.args.newpath, newpathptr);
+    return CALL_WITH_OUTPUTS(
+        msg, needs_await,
+        int, (renameat2, olddirfd, oldpath, newdirfd, newpath, flags),
+        {
+            msg.args.oldpath.out_effect = OUT_EFFECT_IF_NOT_ERROR(
+                -1, (flags & RENAME_EXCHANGE) ? OUT_EFFECT_CHANGED : OUT_EFFECT_DELETED);
+            msg.args.newpath.out_effect = OUT_EFFECT_IF_NOT_ERROR(-1, OUT_EFFECT_CHANGED);
+        });
+}
+
 /* Outputs the full path */
 DEFINE_WRAPPER(int, chmod, (const char *path, mode_t mode))
 {
@@ -383,6 +549,29 @@ DEFINE_WRAPPER(int, mkdir, (const char *path, mode_t mode))
         });
 }
 
+/* Outputs the full path */
+DEFINE_WRAPPER(int, mkdirat, (int dirfd, const char *path, mode_t mode))
+{
+    char fullpath[MAX_PATH];
+    const char *pathptr = path;
+    initialize_process_state();
+    if (AT_FDCWD != dirfd && path[0] != '/') {
+        if (!get_fullpath_of_dirfd(PS(fullpath), dirfd, path)) return -1;
+        TRACE_DEBUG("mkdirat %d, %s -> %s", dirfd, path, fullpath);
+        pathptr = fullpath;
+    }
+    bool needs_await = false;
+    DEFINE_MSG(msg, mkdir);
+    OUT_PATH_COPY(needs_await, msg.args.path, pathptr);
+    msg.args.mode = mode;
+    return CALL_WITH_OUTPUTS(
+        msg, needs_await,
+        int, (mkdirat, dirfd, path, mode),
+        {
+            msg.args.path.out_effect = OUT_EFFECT_IF_NOT_ERROR(-1, OUT_EFFECT_CREATED);
+        });
+}
+
 /* Outputs the full path */
 DEFINE_WRAPPER(int, rmdir, (const char *path))
 {
@@ -646,7 +835,7 @@ DEFINE_WRAPPER(int, execve, (const char *filename, char *const argv[], char *con
             if(is_create)    msg.args.flags |= FLAG_CREATE;             \
             if(is_truncate)  msg.args.flags |= FLAG_TRUNCATE;           \
             msg.args.mode = mode;                                       \
-            return CALL_WITH_OUTPUTS(                                   \
+            int fd = CALL_WITH_OUTPUTS(                                 \
                 msg, needs_await,                                       \
                 int, (_name, _path, _flags, mode),                      \
                 {                                                       \
@@ -654,6 +843,8 @@ DEFINE_WRAPPER(int, execve, (const char *filename, char *const argv[], char *con
                         OUT_EFFECT_IF_NOT_ERROR(                        \
                             -1, is_truncate ? OUT_EFFECT_CREATED : OUT_EFFECT_CHANGED); \
                 });                                                     \
+            if(needs_await) track_written_fd(fd, msg.args.path.out_path); \
+            return fd;                                                  \
         }                                                               \
         }                                                               \
         LOG(error, "invalid open mode?!");                              \
@@ -757,13 +948,15 @@ struct fopen_mode_bools fopen_parse_modestr(const char *modestr)
         if(mode.is_create)   msg.args.flags |= FLAG_CREATE;             \
         if(mode.is_truncate) msg.args.flags |= FLAG_TRUNCATE;           \
         msg.args.mode = 0666;                                           \
-        return CALL_WITH_OUTPUTS(                                       \
+        FILE *opened = CALL_WITH_OUTPUTS(                               \
             msg, needs_await, FILE *, (name, path, modestr, ##__VA_ARGS__),               \
             {                                                           \
                 msg.args.path.out_effect =                              \
                     OUT_EFFECT_IF_NOT_ERROR(                            \
                         NULL, mode.is_truncate ? OUT_EFFECT_CREATED : OUT_EFFECT_CHANGED); \
             });                                                         \
+        if(needs_await && opened) track_written_fd(fileno(opened), msg.args.path.out_path); \
+        return opened;                                                  \
     } while(0)
 
 DEFINE_WRAPPER(FILE *, fopen, (const char *path, const char *modestr))
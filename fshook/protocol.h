@@ -30,6 +30,7 @@ enum func {
     func_exec      = 0x10012,
     func_execp     = 0x10013,
     func_realpath  = 0x10014,
+    func_close     = 0x10015,   /* The last fd a path was written through was closed */
 
     /* Send a debug message */
     func_trace     = 0xF0000
@@ -84,6 +85,7 @@ struct func_chown     {out_path path; uint32_t owner; uint32_t group;};
 struct func_exec      {in_path path;};
 struct func_execp     {char file[MAX_EXEC_FILE]; char cwd[MAX_PATH]; char env_var_PATH[MAX_PATH_ENV_VAR_LENGTH]; char conf_str_CS_PATH[MAX_PATH_CONF_STR];};
 struct func_realpath  {in_path path;};
+struct func_close     {out_path path;};
 struct func_trace     {enum severity severity; char msg[1024];};
 
 #endif
@@ -1,4 +1,7 @@
 #include "job.h"
+#include "spawner.h"
+#include "trash.h"
+#include "dir_cache.h"
 #include "assert.h"
 
 #include <sstream>
@@ -8,23 +11,29 @@
 #include <thread>
 #include <chrono>
 #include <condition_variable>
+#include <atomic>
+#include <map>
+#include <memory>
 
 #include <cinttypes>
 
 extern "C" {
 #include <arpa/inet.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <ftw.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include "fshook/protocol.h"
 }
@@ -34,11 +43,19 @@ struct OperationPaths {
     uint32_t input_count;
     const char *output_paths[2];
     uint32_t output_count;
+    // An output the command is done writing
+    const char *closed_output;
+    // The outputs may be directories that are removed or moved
+    bool changes_dirs;
+    // The output is a directory about to be created
+    bool creates_dir;
 };
 
 #define LOG(x) DEBUG(x)
 
 #define SHELL_EXE_PATH "/usr/bin/bash"
+// What runs the commands of the rules, batched or not
+#define COMMAND_SHELL_PATH "/bin/sh"
 #define PROTOCOL_HELLO "PROTOCOL10: HELLO, I AM: "
 #define LD_PRELOAD_PATH "./fs_override.so"
 
@@ -76,64 +93,44 @@ static void safer_dirname(const char *path, char *dirname, uint32_t dirname_max_
     }
 }
 
-static int trigger_listen(const char *addr, struct sockaddr_un *out_addr) {
-    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    ASSERT(-1 != fd);
-    *out_addr = (struct sockaddr_un){
-        .sun_family = AF_UNIX,
-        .sun_path = {0},
-    };
-    ASSERT(strlen(addr) < sizeof(out_addr->sun_path));
-    strcpy(out_addr->sun_path, addr);
-
-    LOG("Binding to: " << out_addr->sun_path);
-    ASSERT(0 == bind(fd,
-                     (struct sockaddr *) out_addr,
-                     sizeof(struct sockaddr_un)));
-    ASSERT(0 == listen(fd, 5));
-    return fd;
-}
-
-static bool send_go(int connection_fd) {
-    LOG("GO");
-    return (2 == send(connection_fd, "GO", 2, 0));
+// A leading @ in the address stands for the NUL of an abstract one, which
+// is only as long as the address itself
+static socklen_t unix_sockaddr(const std::string &address, struct sockaddr_un *out_addr)
+{
+    memset(out_addr, 0, sizeof(*out_addr));
+    out_addr->sun_family = AF_UNIX;
+    ASSERT(address.size() < sizeof(out_addr->sun_path));
+    memcpy(out_addr->sun_path, address.data(), address.size());
+    if (address[0] != '@') return sizeof(*out_addr);
+    out_addr->sun_path[0] = '\0';
+    return offsetof(struct sockaddr_un, sun_path) + address.size();
 }
 
-static bool checked_recv(int sockfd, void *buf, size_t len)
-{
-    char *pos = (char *)buf;
-    uint32_t received_amount = 0;
-    while (true) {
-        int received = recv(sockfd, pos, len - received_amount, 0);
-        if (received < 0) {
-            // perror("recv");
-            LOG("recv returned: " << received << " errno: " << errno);
-            return false;
-        }
-        if (received == 0) {
-            LOG("recv returned 0, socket closed?");
-            return false;
-        }
-        pos += received;
-        received_amount += (uint32_t)received;
-        if (received_amount == len) {
-            return true;
+static int trigger_listen(std::string *out_address) {
+    // Commands connect by address; they must not inherit the listening fd
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ASSERT(-1 != fd);
+    for (uint32_t attempt = 0; ; attempt++) {
+        std::ostringstream address;
+        address << "@trigger." << getpid() << "." << attempt;
+        struct sockaddr_un addr;
+        const socklen_t addr_len = unix_sockaddr(address.str(), &addr);
+        LOG("Binding to: " << address.str());
+        if (0 == bind(fd, (struct sockaddr *) &addr, addr_len)) {
+            *out_address = address.str();
+            break;
         }
-        LOG("need moar bytes, have " << received_amount << "/" << len);
+        // Masters in other pid namespaces may share our network namespace
+        ASSERT(EADDRINUSE == errno);
     }
+    // Connections are accepted as soon as they come, however many at once
+    ASSERT(0 == listen(fd, SOMAXCONN));
+    return fd;
 }
 
-static bool recv_buf(int connection_fd, char *buf, uint32_t buf_size, std::size_t *out_received)
-{
-    uint32_t size_n;
-    if (!checked_recv(connection_fd, &size_n, sizeof(size_n))) return false;
-    const uint32_t size = htonl(size_n);
-    *out_received = size;
-    if (size == 0) return true;
-
-    // LOG("recv size: " << size);
-    ASSERT(buf_size > size);
-    return checked_recv(connection_fd, buf, size);
+static bool send_go(int connection_fd) {
+    LOG("GO");
+    return (2 == send(connection_fd, "GO", 2, MSG_NOSIGNAL));
 }
 
 static void debug_req(enum func func_id, bool delayed, uint32_t str_size)
@@ -161,6 +158,7 @@ static void debug_req(enum func func_id, bool delayed, uint32_t str_size)
     case func_exec: name = "exec"; break;
     case func_execp: name = "execp"; break;
     case func_realpath: name = "realpath"; break;
+    case func_close: name = "close"; break;
     case func_trace: name ="trace"; break;
     default: PANIC("Invalid func_id: " << func_id);
     }
@@ -173,33 +171,21 @@ static void debug_req(enum func func_id, bool delayed, uint32_t str_size)
     (void)str_size;
 }
 
-static bool wait_for(pid_t child, const std::string &cmd __attribute__((unused))) {
-    int wait_res;
-    int wait_child = waitpid(child, &wait_res, WNOHANG);
-    if ((wait_child < 0) && (errno == EINTR)) {
-        return false;
-    }
-    ASSERT(wait_child >= 0);
-    if (wait_child == 0) {
-        return false;
-    }
-    ASSERT(wait_child == child);
-    if (WEXITSTATUS(wait_res) != 0) {
-        DEBUG("BUILD FAILED: Child process " << child << " exited with status: " << WEXITSTATUS(wait_res));
-        DEBUG("BUILD FAILED: Failing command: " << cmd);
-        exit(1);
-    }
-    return true;
+// The child's exit status as a shell reports it
+static int exit_status_of(int wait_status)
+{
+    return WIFEXITED(wait_status) ? WEXITSTATUS(wait_status) : (128 + WTERMSIG(wait_status));
 }
 
-static __thread uint64_t connections_accepted = 0;
-
 static void get_input_paths(enum func func_id, const char *buf, uint32_t buf_size,
                             struct OperationPaths *out_paths)
 {
     LOG("func_id: " << func_id);
     out_paths->input_count = 0;
     out_paths->output_count = 0;
+    out_paths->closed_output = nullptr;
+    out_paths->changes_dirs = false;
+    out_paths->creates_dir = false;
     switch (func_id) {
     case func_openr: {
         DEFINE_DATA(struct func_openr, buf, buf_size, data);
@@ -284,6 +270,7 @@ static void get_input_paths(enum func func_id, const char *buf, uint32_t buf_siz
         DEFINE_DATA(struct func_unlink, buf, buf_size, data);
         out_paths->output_paths[0] = data->path.out_path;
         out_paths->output_count = 1;
+        out_paths->changes_dirs = true;
         break;
     }
     case func_chmod: {
@@ -302,12 +289,14 @@ static void get_input_paths(enum func func_id, const char *buf, uint32_t buf_siz
         DEFINE_DATA(struct func_mkdir, buf, buf_size, data);
         out_paths->output_paths[0] = data->path.out_path;
         out_paths->output_count = 1;
+        out_paths->creates_dir = true;
         break;
     }
     case func_rmdir: {
         DEFINE_DATA(struct func_rmdir, buf, buf_size, data);
         out_paths->output_paths[0] = data->path.out_path;
         out_paths->output_count = 1;
+        out_paths->changes_dirs = true;
         break;
     }
     case func_chown: {
@@ -321,6 +310,7 @@ static void get_input_paths(enum func func_id, const char *buf, uint32_t buf_siz
         out_paths->output_paths[0] = data->oldpath.out_path;
         out_paths->output_paths[1] = data->newpath.out_path;
         out_paths->output_count = 2;
+        out_paths->changes_dirs = true;
         break;
     }
     case func_link: {
@@ -330,6 +320,11 @@ static void get_input_paths(enum func func_id, const char *buf, uint32_t buf_siz
         out_paths->output_count = 2;
         break;
     }
+    case func_close: {
+        DEFINE_DATA(struct func_close, buf, buf_size, data);
+        out_paths->closed_output = data->path.out_path;
+        break;
+    }
     case func_trace: {
         DEFINE_DATA(struct func_trace, buf, buf_size, data);
         LOG("TRACE: " << data->msg);
@@ -339,18 +334,107 @@ static void get_input_paths(enum func func_id, const char *buf, uint32_t buf_siz
     }
 }
 
-static void handle_connection(Job &job, int connection_fd)
+// Splits a HELLO into the job ID the client introduced itself with and
+// what it connected for: HOOK, or BUILD for a nested invocation of ours
+static Optional<std::string> parse_hello(const char *buf, uint32_t size, std::string *out_need)
 {
-    char buf[0x8000];
-    std::size_t size;
-    if (!recv_buf(connection_fd, buf, sizeof(buf), &size)) return;
-    if (0 != strncmp(PROTOCOL_HELLO, buf, std::min(size, strlen(PROTOCOL_HELLO)))) {
-        PANIC("Exepcting HELLO message, got: " << buf);
+    if (0 != strncmp(PROTOCOL_HELLO, buf, std::min((std::size_t)size, strlen(PROTOCOL_HELLO)))) {
+        PANIC("Exepcting HELLO message, got: " << std::string(buf, size));
+    }
+    // pid:tid:jobid:need
+    const std::string hello(buf + strlen(PROTOCOL_HELLO), size - strlen(PROTOCOL_HELLO));
+    const std::size_t tid_pos = hello.find(':');
+    const std::size_t job_id_pos = (tid_pos == std::string::npos) ? tid_pos : hello.find(':', tid_pos + 1);
+    const std::size_t need_pos = hello.rfind(':');
+    if ((job_id_pos == std::string::npos) || (need_pos <= job_id_pos)) {
+        PANIC("Malformed HELLO message: " << hello);
+    }
+    *out_need = hello.substr(need_pos + 1);
+    return Optional<std::string>(hello.substr(job_id_pos + 1, need_pos - job_id_pos - 1));
+}
+
+static Reactor *global_reactor = nullptr;
+static DirCache *global_dir_cache = nullptr;
+
+/* One hooked process's connection, served on the reactor thread. The
+ * HELLO names the job it belongs to. A delayed request gets its GO once
+ * every input it needs is built, without a thread waiting for them; the
+ * client sends nothing more on the connection until then. A nested
+ * invocation's BUILD request is answered the same way once all its
+ * targets are built. */
+class HookConnection : public std::enable_shared_from_this<HookConnection> {
+public:
+    // Returns the job the connection belongs to, or null to drop it
+    typedef std::function<Job *(const std::string &job_id)> RouteCb;
+    // Called once the connection is closed, with the job it was routed to
+    typedef std::function<void(Job *)> CloseCb;
+
+    static void serve(int fd, RouteCb route, CloseCb on_close) {
+        std::shared_ptr<HookConnection> connection(new HookConnection(fd, route, on_close));
+        connection->m_handler = global_reactor->add_fd(
+            fd, std::bind(&HookConnection::on_readable, connection));
+    }
+
+private:
+    HookConnection(int fd, RouteCb route, CloseCb on_close)
+        : m_fd(fd), m_route(route), m_on_close(on_close) { }
+
+    void on_readable() {
+        char chunk[0x8000];
+        while (true) {
+            const ssize_t received = recv(m_fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (received > 0) {
+                m_buf.append(chunk, received);
+                continue;
+            }
+            if ((received < 0) && (errno == EINTR)) continue;
+            if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) break;
+            LOG("recv returned: " << received << " errno: " << errno);
+            m_eof = true;
+            global_reactor->remove(m_handler);
+            break;
+        }
+        process_buffered();
+    }
+
+    void process_buffered() {
+        while (!m_closed && (m_pending_inputs == 0) && (m_buf.size() >= sizeof(uint32_t))) {
+            uint32_t size_n;
+            memcpy(&size_n, m_buf.data(), sizeof(size_n));
+            const uint32_t size = ntohl(size_n);
+            ASSERT(size < 0x8000);
+            if (m_buf.size() - sizeof(size_n) < size) break;
+            const std::string msg = m_buf.substr(sizeof(size_n), size);
+            m_buf.erase(0, sizeof(size_n) + size);
+            process(msg.data(), size);
+        }
+        if (m_eof && (m_pending_inputs == 0)) close_connection();
     }
-    if (!send_go(connection_fd)) return;
 
-    while (true) {
-        if (!recv_buf(connection_fd, buf, sizeof(buf), &size)) break;
+    void process(const char *buf, uint32_t size) {
+        if (m_job == nullptr) {
+            const Optional<std::string> job_id = parse_hello(buf, size, &m_need);
+            m_job = m_route(job_id.get_value());
+            if (m_job == nullptr) {
+                // The command it came from already finished
+                close_connection();
+                return;
+            }
+            send_go(m_fd);
+            return;
+        }
+        if (m_need == "BUILD") {
+            // The targets, one per message, end with an empty one
+            if (size > 0) {
+                m_targets.emplace_back(buf, size);
+                return;
+            }
+            std::vector<std::string> targets;
+            targets.swap(m_targets);
+            want_all(targets);
+            return;
+        }
+
         const char *pos = buf;
         const bool delayed = *(const bool*)pos;
         pos += sizeof(delayed);
@@ -361,134 +445,263 @@ static void handle_connection(Job &job, int connection_fd)
 
         struct OperationPaths paths;
         get_input_paths(func_id, pos, str_size, &paths);
-        // LOG(input_path);
-        if (!delayed) continue;
+        if (paths.closed_output != nullptr) m_job->output_closed(paths.closed_output);
+        if (!delayed) return;
+        if (paths.changes_dirs) {
+            for (uint32_t i = 0; i < paths.output_count; i++) m_job->changing(paths.output_paths[i]);
+        }
+        if (paths.creates_dir) m_job->creating_dir(paths.output_paths[0]);
+        std::vector<std::string> inputs;
         for (uint32_t i = 0; i < paths.input_count; i++) {
-            job.want(paths.input_paths[i]);
+            inputs.push_back(paths.input_paths[i]);
         }
-
         for (uint32_t i = 0; i < paths.output_count; i++) {
             char output_path[0x1000];
             LOG("OUTPUT: " << paths.output_paths[i]);
             safer_dirname(paths.output_paths[i], output_path, sizeof(output_path));
-            struct stat output_dir_stat;
-            if (0 != stat(output_path, &output_dir_stat)) {
-                ASSERT(ENOENT == errno);
-                job.want(output_path);
-            }
+            // Only as current as the changes the hook reported, see DirCache
+            if (!global_dir_cache->exists(output_path)) inputs.push_back(output_path);
         }
-        if (!send_go(connection_fd)) break;
+        want_all(inputs);
     }
-}
 
-static Optional<int> trigger_accept(int fd, const struct sockaddr_un *addr)
+    // Sends GO once all the inputs are ready
+    void want_all(const std::vector<std::string> &inputs) {
+        // One extra count until all of them are asked for
+        m_pending_inputs = inputs.size() + 1;
+        std::shared_ptr<HookConnection> self = shared_from_this();
+        for (auto &input : inputs) {
+            m_job->want_async(input, [self]() {
+                    global_reactor->post(std::bind(&HookConnection::input_ready, self));
+                });
+        }
+        // The caller goes on with the next message if they all were ready
+        if (--m_pending_inputs == 0) send_go(m_fd);
+    }
+
+    void input_ready() {
+        ASSERT(m_pending_inputs > 0);
+        if (--m_pending_inputs > 0) return;
+        // Fails harmlessly if the client was killed meanwhile
+        send_go(m_fd);
+        process_buffered();
+    }
+
+    void close_connection() {
+        if (m_closed) return;
+        m_closed = true;
+        if (!m_eof) global_reactor->remove(m_handler);
+        LOG("Closing " << m_fd);
+        close(m_fd);
+        m_on_close(m_job);
+    }
+
+    const int m_fd;
+    Reactor::HandlerId m_handler = 0;
+    RouteCb m_route;
+    CloseCb m_on_close;
+    Job *m_job = nullptr;
+    std::string m_need;
+    std::string m_buf; // received, not yet processed
+    std::vector<std::string> m_targets; // of a BUILD request, so far
+    uint32_t m_pending_inputs = 0;
+    bool m_eof = false;
+    bool m_closed = false;
+};
+
+// Serves every connection waiting on the listening socket
+static void accept_connections(int sock_fd, HookConnection::RouteCb route, HookConnection::CloseCb on_close)
 {
-    socklen_t addrlen = sizeof(struct sockaddr_un);
-    int connection_fd;
-    // if (connections_accepted > 0 && (connections_completed == connections_accepted)) {
-    //     LOG("All connections closed");
-    //     return false;
-    // }
-    connection_fd = accept(fd, (struct sockaddr *)addr, &addrlen);
-    if (connection_fd < 0) {
-        ASSERT(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
-        return Optional<int>();
+    while (true) {
+        const int connection_fd = accept4(sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connection_fd < 0) {
+            if (errno == EINTR) continue;
+            ASSERT((errno == EAGAIN) || (errno == EWOULDBLOCK));
+            return;
+        }
+        LOG("Got connection: " << connection_fd);
+        HookConnection::serve(connection_fd, route, on_close);
     }
-    ASSERT(connection_fd >= 0);
-    // HANDLE CONNECTION
-    connections_accepted++;
-    LOG("Got connection, connections_accepted: " << connections_accepted);
-
-    return Optional<int>(connection_fd);
 }
 
-void Job::want(std::string input)
+void Job::want_async(std::string input, std::function<void(void)> done)
 {
     for (auto output : this->m_rule.outputs) {
-        if (output == input) return;
+        if (output == input) {
+            done();
+            return;
+        }
     }
-    std::condition_variable cv;
+    {
+        std::unique_lock<std::mutex> lck (m_inputs_mtx);
+        m_inputs.push_back(input);
+    }
+    DEBUG("[WANT ] " << this->m_rule.outputs.front() << " wants: " << input);
+    this->m_resolve_input_cb(input, done);
+}
+
+void Job::want_all(const std::vector<std::string> &inputs)
+{
+    // All of them are requested before waiting, so they build in parallel
     std::mutex mtx;
-    mtx.lock();
-    this->m_resolve_input_cb(input,
-                             [&](){
-                                 mtx.unlock();
-                             });
-    DEBUG("[STOP ] " << this->m_rule.outputs.front() << " waiting for: " << input);
-    mtx.lock();
-    DEBUG("[CONT ] " << this->m_rule.outputs.front() << " waiting for: " << input << " [DONE]");
+    std::condition_variable cv;
+    uint32_t pending = inputs.size();
+    for (auto &input : inputs) {
+        this->want_async(input, [&](){
+                std::unique_lock<std::mutex> lck (mtx);
+                if (--pending == 0) cv.notify_all();
+            });
+    }
+    std::unique_lock<std::mutex> lck (mtx);
+    while (pending > 0) cv.wait(lck);
+}
+
+void Job::output_closed(const std::string &path)
+{
+    if (!m_rule.early_outputs || !m_output_closed_cb) return;
+    for (auto &output : m_rule.outputs) {
+        if (output == path) {
+            m_output_closed_cb(path);
+            return;
+        }
+    }
+}
+
+std::vector<std::string> Job::inputs() const
+{
+    std::unique_lock<std::mutex> lck (m_inputs_mtx);
+    return m_inputs;
 }
 
+void Job::cancel()
+{
+    m_cancelled = true;
+    const pid_t pgid = m_pgid;
+    if (pgid > 0) kill(-pgid, SIGKILL);
+}
+
+void Job::set_process_group(pid_t pgid)
+{
+    // Whichever of this and cancel() comes second does the killing
+    m_pgid = pgid;
+    if (m_cancelled) kill(-pgid, SIGKILL);
+}
 
-static int remove_fn(const char *fpath, const struct stat *sb UNUSED_ATTR,
-                     int typeflag, struct FTW *ftwbuf UNUSED_ATTR)
+static void print_failure(const Job &job)
 {
-    if (typeflag & FTW_D) {
-        LOG("rmdir " << fpath);
-        ASSERT(0 == rmdir(fpath));
-    } else {
-        LOG("unlink " << fpath);
-        ASSERT(0 == unlink(fpath));
+    if (job.cancelled()) {
+        PRINT("[KILLD] " << job.get_rule().outputs.front());
+        return;
     }
-    return 0;
+    PRINT("[FAIL ] " << job.get_rule().outputs.front() << ": exited with status " << job.exit_status());
+    PRINT("Failing command: " << job.command());
 }
 
-static void remove_dir_recursively(const char *dirpath)
+
+static std::atomic<uint32_t> global_child_idx(0);
+static std::string global_makeflags;
+static HookListener *global_hook_listener = nullptr;
+static Trash *global_trash = nullptr;
+
+void Job::set_makeflags(const std::string &makeflags)
 {
-    const int nopenfd = 10;
-    const int res = nftw(dirpath, remove_fn, nopenfd, FTW_DEPTH);
-    ASSERT(0 == res);
+    global_makeflags = makeflags;
 }
 
-uint32_t global_child_idx = 0;
+void Job::set_reactor(Reactor *reactor)
+{
+    global_reactor = reactor;
+}
 
-void Job::execute()
+void Job::set_hook_listener(HookListener *listener)
 {
-    PRINT("[START] " << this->m_rule.outputs.front());
+    global_hook_listener = listener;
+}
 
-    const uint32_t child_idx = global_child_idx;
-    global_child_idx++;
+void Job::set_trash(Trash *trash)
+{
+    global_trash = trash;
+}
+
+void Job::set_dir_cache(DirCache *dir_cache)
+{
+    global_dir_cache = dir_cache;
+}
 
+std::string Job::command() const
+{
     std::string cmd;
     for (auto line : m_rule.commands) {
         cmd += "\n" + line;
     }
+    return cmd;
+}
 
+void Job::remove_outputs() const
+{
     for (auto output : m_rule.outputs) {
-        struct stat output_file_stat;
-        if (0 == stat(output.c_str(), &output_file_stat)) {
-            PRINT("[REMOV] " << output);
-            if (output_file_stat.st_mode & S_IFDIR) {
-                remove_dir_recursively(output.c_str());
-            } else {
-                LOG("unlink " << output.c_str());
-                ASSERT(0 == unlink(output.c_str()));
-            }
-        } else {
-            ASSERT(ENOENT == errno);
-        }
+        if (!global_trash->discard(output)) continue;
+        PRINT("[REMOV] " << output);
+        global_dir_cache->forget(output);
     }
+}
+
+void Job::changing(const std::string &path)
+{
+    global_dir_cache->begin_changing(path);
+    std::unique_lock<std::mutex> lck (m_inputs_mtx);
+    m_changed_paths.push_back(path);
+}
+
+void Job::creating_dir(const std::string &path)
+{
+    // A directory only appears, so what it is taken for meanwhile can at
+    // worst be missing, which is safe
+    global_dir_cache->forget(path);
+    std::unique_lock<std::mutex> lck (m_inputs_mtx);
+    m_created_dirs.push_back(path);
+}
 
-    std::ostringstream stringStream;
-    stringStream << "/tmp/trigger.sock." << getpid() << "." << child_idx;
-    const std::string sockAddr = stringStream.str();
+void Job::forget_changes()
+{
+    std::vector<std::string> changed_paths, created_dirs;
+    {
+        std::unique_lock<std::mutex> lck (m_inputs_mtx);
+        changed_paths.swap(m_changed_paths);
+        created_dirs.swap(m_created_dirs);
+    }
+    for (auto &path : changed_paths) global_dir_cache->end_changing(path);
+    for (auto &path : created_dirs) global_dir_cache->forget(path);
+    // Directory outputs exist now, or are gone if the commands failed
+    for (auto &output : m_rule.outputs) global_dir_cache->forget(output);
+}
 
-    LOG("Forking child: " << cmd);
+bool Job::execute()
+{
+    PRINT("[START] " << this->m_rule.outputs.front());
+
+    const std::string job_id = std::to_string(global_child_idx++);
+
+    const std::string cmd = this->command();
+    this->remove_outputs();
+
+    LOG("Spawning child: " << cmd);
     // PRINT("Build: '" << target_ctx->path << "'");
 
-    int parent_child_pipe[2];
-    ASSERT(0 == pipe(parent_child_pipe));
-    const pid_t child = fork();
+    // Registered before the command starts, so its first hooked call is served
+    global_hook_listener->add_job(job_id, this);
+
     char *const cwd = get_current_dir_name();
 
     auto ld_preload_full = std::string(cwd) + std::string("/") + std::string(LD_PRELOAD_PATH);
     auto path                           =    std::string("PATH=") + std::string(getenv("PATH"));
     auto ld_preload                     =    std::string("LD_PRELOAD=") + ld_preload_full;
-    auto buildsome_master_unix_sockaddr =    std::string("BUILDSOME_MASTER_UNIX_SOCKADDR=") + std::string(sockAddr);
-    auto buildsome_job_id               =    std::string("BUILDSOME_JOB_ID=") + std::to_string(child_idx);
+    auto buildsome_master_unix_sockaddr =    std::string("BUILDSOME_MASTER_UNIX_SOCKADDR=") + global_hook_listener->address();
+    auto buildsome_job_id               =    std::string("BUILDSOME_JOB_ID=") + job_id;
     auto buildsome_root_filter          =    std::string("BUILDSOME_ROOT_FILTER=") + std::string(cwd);
 //  , ("DYLD_FORCE_FLAT_NAMESPACE", "1")
     auto dyld_insert_libraries          =    std::string("DYLD_INSERT_LIBRARIES=") + ld_preload_full;
+    auto makeflags                      =    std::string("MAKEFLAGS=") + global_makeflags;
 
     const char *envir[] = {
         path.c_str(),
@@ -496,82 +709,208 @@ void Job::execute()
         buildsome_master_unix_sockaddr.c_str(),
         buildsome_job_id.c_str(),
         buildsome_root_filter.c_str(),
+        m_rule.early_outputs ? "BUILDSOME_REPORT_CLOSES=1" : "BUILDSOME_REPORT_CLOSES=0",
         dyld_insert_libraries.c_str(),
         "DYLD_FORCE_FLAT_NAMESPACE=1",
         "PYTHONDONTWRITEBYTECODE=1",
+        global_makeflags.empty() ? NULL : makeflags.c_str(),
+        NULL,
     };
     free(cwd);
-    if (0 == child) {
-        close(parent_child_pipe[1]);
-        // LOG("Waiting for parent...");
-
-        bool yup = false;
-        char *yup_result = (char *)&yup;
-        uint32_t to_read = sizeof(yup);
-        while (to_read > 0) {
-            int read_res = read(parent_child_pipe[0], yup_result, to_read);
-            ASSERT(read_res > 0);
-            yup_result += read_res;
-            to_read -= read_res;
-        }
-        ASSERT(yup);
-        // LOG("Starting...");
-
-        close(parent_child_pipe[0]);
-        const char *const args[] = { SHELL_EXE_PATH, "-ec", cmd.c_str(), NULL };
-        execvpe("/bin/sh", (char *const*)args, (char *const*)envir);
-        PANIC("exec failed?!");
-    }
-
-    close(parent_child_pipe[0]);
-    // LOG("Forked child: %d", child);
-
-    struct sockaddr_un addr;
-    int sock_fd = trigger_listen(sockAddr.c_str(), &addr);
-
-    const bool parent_yup = true;
-    ASSERT(sizeof(parent_yup) == write(parent_child_pipe[1], &parent_yup, sizeof(parent_yup)));
-
-    // LOG("Sent yup");
-
-    std::vector<std::thread *> threads;
-    while (!wait_for(child, cmd)) {
-        const Optional<int> o_conn_fd = trigger_accept(sock_fd, &addr);
-        if (o_conn_fd.has_value()) {
-            std::mutex mtx;
-            bool started = false;
-            int connection_fd = o_conn_fd.get_value();
-            LOG("Spawning: " << connection_fd);
-            std::thread *accept_thread = new std::thread([&](){
-                    LOG("Handling: " << connection_fd);
-                    {
-                        std::unique_lock<std::mutex> lck (mtx);
-                        started = true;
-                    }
-                    LOG("Started Handling: " << connection_fd);
-                    handle_connection(*this, connection_fd);
-                    LOG("Closing " << connection_fd);
-                    close(connection_fd);
-                });
-            threads.emplace_back(accept_thread);
-            while (true) {
-                std::unique_lock<std::mutex> lck (mtx);
-                if (started) break;
-                lck.unlock();
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            }
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    }
 
-    for (auto th : threads) {
-        th->join();
-        delete th;
+    const char *const args[] = { SHELL_EXE_PATH, "-ec", cmd.c_str(), NULL };
+    // Its process group exists once this returns
+    const pid_t child = spawn_process(COMMAND_SHELL_PATH, args, envir);
+    // LOG("Spawned child: %d", child);
+    this->set_process_group(child);
+
+    // The child's exit and its connections are handled on the reactor
+    // thread; this one only waits for both to be over
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool exited = false;
+    struct rusage usage;
+    global_reactor->watch_child(child, [&](int wait_status, const struct rusage &child_usage) {
+            // Its pid may be reused from here on
+            this->m_pgid = 0;
+            std::unique_lock<std::mutex> lck (mtx);
+            exited = true;
+            this->m_exit_status = exit_status_of(wait_status);
+            // The shell waits for everything it runs, so its usage covers the whole command
+            usage = child_usage;
+            cv.notify_all();
+        });
+
+    {
+        std::unique_lock<std::mutex> lck (mtx);
+        while (!exited) cv.wait(lck);
     }
-    // LOG("Done accepting, waiting for child: %d", child);
     LOG("Child terminated: " << child);
-    close(sock_fd);
-
+    // Connections of exited processes only have what they sent last to read
+    global_hook_listener->remove_job(job_id);
+    this->forget_changes();
+    this->m_peak_rss_kb = usage.ru_maxrss;
+    this->m_cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+
+    if (this->m_exit_status != 0) {
+        print_failure(*this);
+        return false;
+    }
     PRINT("[DONE ] " << this->m_rule.outputs.front());
     // PRINT("Build: '" << target_ctx->path << "' - Done");
+    return true;
+}
+
+HookListener::HookListener(Reactor &reactor)
+    : m_reactor(reactor)
+{
+    m_sock_fd = trigger_listen(&m_address);
+    m_handler = m_reactor.add_fd(m_sock_fd, [this]() {
+            accept_connections(m_sock_fd,
+                               std::bind(&HookListener::route, this, std::placeholders::_1),
+                               std::bind(&HookListener::connection_closed, this, std::placeholders::_1));
+        });
+}
+
+HookListener::~HookListener()
+{
+    m_reactor.remove(m_handler);
+    // Nothing to unlink: the address goes away with the socket
+    close(m_sock_fd);
+}
+
+void HookListener::add_job(const std::string &job_id, Job *job)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    m_jobs[job_id] = job;
+}
+
+void HookListener::remove_job(const std::string &job_id)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    auto found = m_jobs.find(job_id);
+    ASSERT(found != m_jobs.end());
+    Job *const job = found->second;
+    m_jobs.erase(found);
+    while (m_connections[job] > 0) m_cv.wait(lck);
+    m_connections.erase(job);
+}
+
+Job *HookListener::route(const std::string &job_id)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    auto found = m_jobs.find(job_id);
+    // Null if the command it came from already finished
+    if (found == m_jobs.end()) return nullptr;
+    m_connections[found->second]++;
+    return found->second;
+}
+
+void HookListener::connection_closed(Job *job)
+{
+    if (job == nullptr) return;
+    std::unique_lock<std::mutex> lck (m_mtx);
+    m_connections[job]--;
+    m_cv.notify_all();
+}
+
+
+static std::string shell_quote(const std::string &str)
+{
+    std::string quoted = "'";
+    for (auto c : str) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+ShellBatch::ShellBatch()
+{
+    int commands_pipe[2], status_pipe[2];
+    ASSERT(0 == pipe2(commands_pipe, O_CLOEXEC));
+    ASSERT(0 == pipe2(status_pipe, O_CLOEXEC));
+
+    char *const cwd = get_current_dir_name();
+    // LD_PRELOAD and the job ID are set per command; the shell itself is not hooked
+    auto path                           =    std::string("PATH=") + std::string(getenv("PATH"));
+    auto buildsome_master_unix_sockaddr =    std::string("BUILDSOME_MASTER_UNIX_SOCKADDR=") + global_hook_listener->address();
+    auto buildsome_root_filter          =    std::string("BUILDSOME_ROOT_FILTER=") + std::string(cwd);
+    auto makeflags                      =    std::string("MAKEFLAGS=") + global_makeflags;
+    const char *envir[] = {
+        path.c_str(),
+        buildsome_master_unix_sockaddr.c_str(),
+        buildsome_root_filter.c_str(),
+        "DYLD_FORCE_FLAT_NAMESPACE=1",
+        "PYTHONDONTWRITEBYTECODE=1",
+        global_makeflags.empty() ? NULL : makeflags.c_str(),
+        NULL,
+    };
+    free(cwd);
+
+    // Commands come in on stdin, exit statuses go out on fd 3. This shell is
+    // bash for its job control without a terminal; the commands it starts
+    // run under the same shell as unbatched ones
+    const char *const args[] = { SHELL_EXE_PATH, "-s", NULL };
+    m_shell = spawn_process(SHELL_EXE_PATH, args, envir,
+                            { std::make_pair(commands_pipe[0], 0), std::make_pair(status_pipe[1], 3) });
+    close(commands_pipe[0]);
+    close(status_pipe[1]);
+    m_commands_fd = commands_pipe[1];
+    m_status = fdopen(status_pipe[0], "r");
+    ASSERT(m_status);
+    // Job control puts every command in a process group of its own
+    const char set_monitor[] = "set -m\n";
+    ASSERT((ssize_t)strlen(set_monitor) == write(m_commands_fd, set_monitor, strlen(set_monitor)));
+}
+
+ShellBatch::~ShellBatch()
+{
+    close(m_commands_fd);
+    int wait_res;
+    ASSERT(m_shell == waitpid(m_shell, &wait_res, 0));
+    fclose(m_status);
+}
+
+bool ShellBatch::execute(Job &job)
+{
+    const BuildRule &rule = job.get_rule();
+    PRINT("[START] " << rule.outputs.front());
+    const std::string job_id = std::to_string(global_child_idx++);
+    job.remove_outputs();
+    global_hook_listener->add_job(job_id, &job);
+
+    char *const cwd = get_current_dir_name();
+    const std::string ld_preload_full = std::string(cwd) + std::string("/") + std::string(LD_PRELOAD_PATH);
+    free(cwd);
+    std::ostringstream line;
+    line << "LD_PRELOAD=" << shell_quote(ld_preload_full)
+         << " DYLD_INSERT_LIBRARIES=" << shell_quote(ld_preload_full)
+         << " BUILDSOME_JOB_ID=" << job_id
+         << " BUILDSOME_REPORT_CLOSES=" << (rule.early_outputs ? 1 : 0)
+         << " " COMMAND_SHELL_PATH " -ec " << shell_quote(job.command())
+         << " </dev/null 3>&- & echo $! >&3; wait $!; echo $? >&3\n";
+    const std::string line_str = line.str();
+    ASSERT((ssize_t)line_str.size() == write(m_commands_fd, line_str.c_str(), line_str.size()));
+
+    // The command's pid, then its exit status; the shell only goes away
+    // if something outside kills it
+    int pid = 0, status = -1;
+    if (1 == fscanf(m_status, "%d", &pid)) job.set_process_group(pid);
+    if ((pid <= 0) || (1 != fscanf(m_status, "%d", &status))) status = -1;
+    job.m_pgid = 0;
+    global_hook_listener->remove_job(job_id);
+    job.forget_changes();
+
+    if (status != 0) {
+        job.m_exit_status = status;
+        print_failure(job);
+        return false;
+    }
+    PRINT("[DONE ] " << rule.outputs.front());
+    return true;
 }
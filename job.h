@@ -3,27 +3,158 @@
 #include "optional.h"
 #include "fs_tree.h"
 #include "build_rules.h"
+#include "reactor.h"
 
+#include <cinttypes>
 #include <vector>
 #include <string>
 #include <functional>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <map>
+
+extern "C" {
+#include <stdio.h>
+#include <sys/types.h>
+}
+
+class HookListener;
+class Trash;
+class DirCache;
 
 class Job {
-    BuildRule m_rule;
+    const BuildRule &m_rule;
     std::function<void(std::string,
                        std::function<void(void)>)> m_resolve_input_cb;
+    std::function<void(std::string)> m_output_closed_cb;
+    uint64_t m_peak_rss_kb = 0;
+    uint64_t m_cpu_us = 0;
+    int m_exit_status = 0;
+    // The command runs in a process group of its own, so it can be killed
+    // along with everything it started
+    std::atomic<pid_t> m_pgid;
+    std::atomic<bool> m_cancelled;
+    // Every path the commands asked for through the hook, and the ones
+    // they may have created, removed or moved
+    mutable std::mutex m_inputs_mtx;
+    std::vector<std::string> m_inputs;
+    std::vector<std::string> m_changed_paths;
+    std::vector<std::string> m_created_dirs;
+
+    friend class ShellBatch;
+    void set_process_group(pid_t pgid);
+    // Once the commands are done, what they changed is looked up afresh
+    void forget_changes();
 
 public:
     explicit Job(const BuildRule &rule,
                  std::function<void(std::string,
-                                    std::function<void(void)>)> resolve_input_cb)
+                                    std::function<void(void)>)> resolve_input_cb,
+                 std::function<void(std::string)> output_closed_cb = nullptr)
         : m_rule(rule)
         , m_resolve_input_cb(resolve_input_cb)
+        , m_output_closed_cb(output_closed_cb)
+        , m_pgid(0)
+        , m_cancelled(false)
     {
     };
 
     const BuildRule &get_rule() const { return m_rule; }
-    void execute();
-    void want(std::string);
+    // Resource usage of the finished command, 0 if not measured
+    uint64_t peak_rss_kb() const { return m_peak_rss_kb; }
+    uint64_t cpu_us() const { return m_cpu_us; }
+    int exit_status() const { return m_exit_status; }
+    bool cancelled() const { return m_cancelled; }
+    // Returns whether the command succeeded
+    bool execute();
+    std::string command() const;
+    void remove_outputs() const;
+    // Passed to every command, so sub-makes join our jobserver
+    static void set_makeflags(const std::string &makeflags);
+    // Serves the commands' hook connections and reaps them; must be set
+    // before any job runs
+    static void set_reactor(Reactor *reactor);
+    // Where every command's hook connects; must be set before any job runs
+    static void set_hook_listener(HookListener *listener);
+    // Where remove_outputs() puts old outputs; must be set before any job runs
+    static void set_trash(Trash *trash);
+    // Answers whether output directories exist; must be set before any job runs
+    static void set_dir_cache(DirCache *dir_cache);
+    // Calls done once the input is built, maybe right away
+    void want_async(std::string input, std::function<void(void)> done);
+    // Returns once all the inputs are built; they build in parallel
+    void want_all(const std::vector<std::string> &inputs);
+    std::vector<std::string> inputs() const;
+    // The commands are about to remove or move the path
+    void changing(const std::string &path);
+    // The commands are about to create the directory
+    void creating_dir(const std::string &path);
+    // The commands closed the last fd they wrote the path through. For a
+    // rule with early outputs, an output of it is then final.
+    void output_closed(const std::string &path);
+    // Kills the command's process group, now or as soon as it has one.
+    // Safe to call from any thread.
+    void cancel();
+};
+
+/* The one socket the hooks of all commands connect to, for as long as the
+ * build runs. It is in the abstract namespace, so it leaves nothing behind
+ * in the filesystem. Each command runs with its own BUILDSOME_JOB_ID,
+ * which the hook sends in its HELLO, and the connection is served on
+ * behalf of the job registered under that ID. */
+class HookListener {
+public:
+    explicit HookListener(Reactor &reactor);
+    ~HookListener();
+
+    // For BUILDSOME_MASTER_UNIX_SOCKADDR; a leading @ stands for the NUL
+    // that starts an abstract address
+    const std::string &address() const { return m_address; }
+    // Connections with this ID are served on behalf of the job from now on
+    void add_job(const std::string &job_id, Job *job);
+    // Drops later connections with this ID, and returns once the job's
+    // open ones are closed
+    void remove_job(const std::string &job_id);
+
+    HookListener(const HookListener &) =delete;
+    HookListener& operator=(const HookListener &) =delete;
+
+private:
+    Job *route(const std::string &job_id);
+    void connection_closed(Job *job);
+
+    Reactor &m_reactor;
+    std::string m_address;
+    int m_sock_fd;
+    Reactor::HandlerId m_handler;
+
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::map<std::string, Job *> m_jobs; // by job ID
+    std::map<Job *, uint32_t> m_connections; // live ones
+};
+
+/* Runs the commands of many small rules one after another in a single
+ * supervising shell, saving each of them a spawn by the master. Each
+ * command runs with its own BUILDSOME_JOB_ID, so accesses are attributed
+ * to the right rule. With job control on in the shell, each command also
+ * gets a process group of its own. */
+class ShellBatch {
+public:
+    ShellBatch();
+    ~ShellBatch();
+
+    // Runs the job's commands and returns once they are done, with whether
+    // they succeeded
+    bool execute(Job &job);
+
+    ShellBatch(const ShellBatch &) =delete;
+    ShellBatch& operator=(const ShellBatch &) =delete;
+
+private:
+    pid_t m_shell;
+    int m_commands_fd;
+    FILE *m_status;
 };
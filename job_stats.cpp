@@ -0,0 +1,167 @@
+#include "job_stats.h"
+#include "assert.h"
+
+#include <fstream>
+#include <sstream>
+
+extern "C" {
+#include <stdio.h>
+}
+
+#define DEFAULT_DURATION_US (1000 * 1000)
+
+JobStats::JobStats(std::string path)
+    : m_path(path)
+{
+}
+
+void JobStats::load()
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    std::ifstream file(m_path);
+    if (!file.is_open()) {
+        DEBUG("No job stats at: " << m_path);
+        return;
+    }
+    RuleStats *current = nullptr;
+    std::string line;
+    while (std::getline(file, line)) {
+        const std::size_t tab = line.find('\t');
+        if (tab == std::string::npos) continue;
+        const std::string key = line.substr(0, tab);
+        const std::string value = line.substr(tab + 1);
+        if (key == "rule") {
+            current = &m_rules[value];
+            continue;
+        }
+        if (!current) continue;
+        if (key == "duration_us") {
+            current->duration_us = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "peak_rss_kb") {
+            current->peak_rss_kb = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "cpu_us") {
+            current->cpu_us = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "usage_duration_us") {
+            current->usage_duration_us = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "want") {
+            current->wants.push_back(value);
+        } else if (key == "command_hash") {
+            current->command_hash = value;
+        } else if ((key == "input_hash") || (key == "output_hash")) {
+            // "<hash> <path>"
+            const std::size_t space = value.find(' ');
+            if (space == std::string::npos) continue;
+            auto &hashes = (key == "input_hash") ? current->input_hashes : current->output_hashes;
+            hashes.push_back(std::make_pair(value.substr(space + 1), value.substr(0, space)));
+        }
+    }
+    DEBUG("Loaded stats for " << m_rules.size() << " rules from: " << m_path);
+}
+
+void JobStats::save() const
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    // Write aside and rename, so an interrupted build keeps the old stats
+    const std::string tmp_path = m_path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        if (!file.is_open()) {
+            PRINT("Failed to write job stats: " << tmp_path);
+            return;
+        }
+        for (auto &it : m_rules) {
+            file << "rule\t" << it.first << "\n";
+            file << "duration_us\t" << it.second.duration_us << "\n";
+            file << "peak_rss_kb\t" << it.second.peak_rss_kb << "\n";
+            file << "cpu_us\t" << it.second.cpu_us << "\n";
+            file << "usage_duration_us\t" << it.second.usage_duration_us << "\n";
+            for (auto &want : it.second.wants) {
+                file << "want\t" << want << "\n";
+            }
+            if (it.second.command_hash.size() > 0) {
+                file << "command_hash\t" << it.second.command_hash << "\n";
+            }
+            for (auto &hash : it.second.input_hashes) {
+                file << "input_hash\t" << hash.second << " " << hash.first << "\n";
+            }
+            for (auto &hash : it.second.output_hashes) {
+                file << "output_hash\t" << hash.second << " " << hash.first << "\n";
+            }
+        }
+    }
+    ASSERT(0 == rename(tmp_path.c_str(), m_path.c_str()));
+}
+
+Optional<RuleStats> JobStats::get(const std::string &rule_name) const
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    auto found = m_rules.find(rule_name);
+    if (found == m_rules.end()) return Optional<RuleStats>();
+    return Optional<RuleStats>(found->second);
+}
+
+void JobStats::record_duration(const std::string &rule_name, uint64_t duration_us)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    m_rules[rule_name].duration_us = duration_us;
+}
+
+void JobStats::record_usage(const std::string &rule_name, uint64_t peak_rss_kb, uint64_t cpu_us)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    RuleStats &stats = m_rules[rule_name];
+    stats.peak_rss_kb = peak_rss_kb;
+    stats.cpu_us = cpu_us;
+    stats.usage_duration_us = stats.duration_us;
+}
+
+void JobStats::record_wants(const std::string &rule_name, const std::vector<std::string> &wants)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    m_rules[rule_name].wants = wants;
+}
+
+void JobStats::record_hashes(const std::string &rule_name, const std::string &command_hash,
+                             const std::vector<std::pair<std::string, std::string> > &input_hashes,
+                             const std::vector<std::pair<std::string, std::string> > &output_hashes)
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    RuleStats &stats = m_rules[rule_name];
+    stats.command_hash = command_hash;
+    stats.input_hashes = input_hashes;
+    stats.output_hashes = output_hashes;
+}
+
+uint64_t JobStats::default_duration_us() const
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    uint64_t total = 0, count = 0;
+    for (auto &it : m_rules) {
+        if (it.second.duration_us == 0) continue;
+        total += it.second.duration_us;
+        count++;
+    }
+    return (count > 0) ? (total / count) : DEFAULT_DURATION_US;
+}
+
+RuleStats JobStats::default_usage() const
+{
+    TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+    RuleStats result;
+    uint64_t count = 0;
+    for (auto &it : m_rules) {
+        if ((it.second.duration_us == 0) || (it.second.peak_rss_kb == 0)) continue;
+        result.duration_us += it.second.duration_us;
+        result.peak_rss_kb += it.second.peak_rss_kb;
+        result.cpu_us += it.second.cpu_us;
+        result.usage_duration_us += it.second.usage_duration_us;
+        count++;
+    }
+    if (count > 0) {
+        result.duration_us /= count;
+        result.peak_rss_kb /= count;
+        result.cpu_us /= count;
+        result.usage_duration_us /= count;
+    }
+    return result;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "optional.h"
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+/* What we remember about a rule from previous builds, keyed by the
+ * rule's first output. */
+struct RuleStats {
+    uint64_t duration_us = 0;
+    uint64_t peak_rss_kb = 0;
+    uint64_t cpu_us = 0; // user plus system time
+    // The duration of the run the usage was measured in; batched runs
+    // are not measured and can be much shorter
+    uint64_t usage_duration_us = 0;
+    // Generated inputs the rule's commands asked for through the hook
+    std::vector<std::string> wants;
+    // Of the last successful run, for early cutoff: the commands, and
+    // (path, hash) of every file the rule read or wrote
+    std::string command_hash;
+    std::vector<std::pair<std::string, std::string> > input_hashes;
+    std::vector<std::pair<std::string, std::string> > output_hashes;
+};
+
+/* Persisted as a text file of "key<TAB>value" lines, where a "rule" line
+ * starts a new record. Unknown keys are skipped, so fields can be added
+ * without invalidating old files. */
+class JobStats {
+public:
+    explicit JobStats(std::string path);
+
+    void load();
+    void save() const;
+
+    Optional<RuleStats> get(const std::string &rule_name) const;
+    void record_duration(const std::string &rule_name, uint64_t duration_us);
+    // Call after record_duration() for the same run
+    void record_usage(const std::string &rule_name, uint64_t peak_rss_kb, uint64_t cpu_us);
+    void record_wants(const std::string &rule_name, const std::vector<std::string> &wants);
+    void record_hashes(const std::string &rule_name, const std::string &command_hash,
+                       const std::vector<std::pair<std::string, std::string> > &input_hashes,
+                       const std::vector<std::pair<std::string, std::string> > &output_hashes);
+
+    // Mean duration over all known rules, used for rules never seen before
+    uint64_t default_duration_us() const;
+    // Means over all rules with recorded usage, likewise
+    RuleStats default_usage() const;
+
+    JobStats(const JobStats &) =delete;
+    JobStats& operator=(const JobStats &) =delete;
+
+private:
+    const std::string m_path;
+    std::map<std::string, RuleStats> m_rules;
+    mutable std::mutex m_mtx;
+};
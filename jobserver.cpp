@@ -0,0 +1,132 @@
+#include "jobserver.h"
+#include "assert.h"
+
+#include <sstream>
+
+extern "C" {
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+}
+
+#define JOBSERVER_TOKEN '+'
+
+// Opens a description of fd's pipe of our own, so that making it
+// non-blocking does not affect the other processes sharing the pipe
+static int reopen_nonblocking(int fd)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    const int new_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    ASSERT(new_fd >= 0);
+    return new_fd;
+}
+
+static bool fd_is_open(int fd)
+{
+    return fcntl(fd, F_GETFD) >= 0;
+}
+
+Jobserver::Jobserver(uint32_t jobs)
+{
+    const char *makeflags = getenv("MAKEFLAGS");
+    if ((makeflags != nullptr) && join(makeflags)) {
+        m_client = true;
+        m_makeflags = makeflags;
+        PRINT("Using the jobserver from MAKEFLAGS");
+        return;
+    }
+    create(jobs);
+}
+
+Jobserver::~Jobserver()
+{
+    trim_to(0);
+    if (m_read_fd >= 0) close(m_read_fd);
+    if (!m_client && (m_write_fd >= 0)) close(m_write_fd);
+}
+
+bool Jobserver::join(const char *makeflags)
+{
+    // The last auth option wins, as in make; --jobserver-fds is the pre-4.2 spelling
+    std::istringstream words(makeflags);
+    std::string word, auth;
+    while (words >> word) {
+        for (auto prefix : { "--jobserver-auth=", "--jobserver-fds=" }) {
+            if (word.compare(0, strlen(prefix), prefix) == 0) auth = word.substr(strlen(prefix));
+        }
+    }
+    if (auth.size() == 0) return false;
+
+    if (auth.compare(0, 5, "fifo:") == 0) {
+        const std::string path = auth.substr(5);
+        m_read_fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        m_write_fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if ((m_read_fd < 0) || (m_write_fd < 0)) {
+            PRINT("Cannot open the jobserver fifo " << path << ", ignoring it");
+            return false;
+        }
+        return true;
+    }
+
+    int read_fd, write_fd;
+    if ((2 != sscanf(auth.c_str(), "%d,%d", &read_fd, &write_fd)) ||
+        !fd_is_open(read_fd) || !fd_is_open(write_fd))
+    {
+        // make leaves the fds out for commands not marked with +
+        PRINT("Jobserver fds from MAKEFLAGS are not available, ignoring them");
+        return false;
+    }
+    m_read_fd = reopen_nonblocking(read_fd);
+    m_write_fd = write_fd;
+    return true;
+}
+
+void Jobserver::create(uint32_t jobs)
+{
+    // Inherited by the commands we run, unlike our other fds
+    int fds[2];
+    ASSERT(0 == pipe(fds));
+    for (uint32_t i = 1; i < jobs; i++) {
+        const char token = JOBSERVER_TOKEN;
+        ASSERT(1 == write(fds[1], &token, 1));
+    }
+    m_read_fd = reopen_nonblocking(fds[0]);
+    m_write_fd = fds[1];
+
+    std::ostringstream makeflags;
+    makeflags << "-j" << jobs
+              << " --jobserver-auth=" << fds[0] << "," << fds[1]
+              << " --jobserver-fds=" << fds[0] << "," << fds[1];
+    m_makeflags = makeflags.str();
+}
+
+bool Jobserver::acquire_for(uint32_t jobs)
+{
+    // Every participant has one implicit token
+    while (m_tokens.size() + 1 < jobs) {
+        char token;
+        const ssize_t res = read(m_read_fd, &token, 1);
+        if (res == 1) {
+            m_tokens.push_back(token);
+            continue;
+        }
+        ASSERT((res < 0) && ((errno == EAGAIN) || (errno == EINTR)));
+        return false;
+    }
+    return true;
+}
+
+void Jobserver::trim_to(uint32_t jobs)
+{
+    while ((m_tokens.size() > 0) && (m_tokens.size() + 1 > jobs)) {
+        const char token = m_tokens.back();
+        const ssize_t res = write(m_write_fd, &token, 1);
+        if ((res < 0) && (errno == EINTR)) continue;
+        ASSERT(res == 1);
+        m_tokens.pop_back();
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+/* A GNU make jobserver: a pipe (or named fifo) holding one byte per job
+ * slot beyond the implicit one every participant starts with.
+ *
+ * When started under make -j, we join the jobserver named in MAKEFLAGS.
+ * Otherwise we create one with jobs - 1 tokens. Either way the commands we
+ * run get MAKEFLAGS pointing at the same jobserver, so sub-makes and
+ * nested builds share our budget instead of adding their own.
+ *
+ * Only the build loop calls acquire_for()/trim_to(). */
+class Jobserver {
+public:
+    explicit Jobserver(uint32_t jobs);
+    ~Jobserver();
+
+    // Holds enough tokens for this many concurrent jobs, returns false if
+    // the jobserver has none to spare right now
+    bool acquire_for(uint32_t jobs);
+    // Gives back tokens beyond what this many concurrent jobs need
+    void trim_to(uint32_t jobs);
+
+    bool is_client() const { return m_client; }
+    // MAKEFLAGS for the commands we run
+    const std::string &makeflags() const { return m_makeflags; }
+
+    Jobserver(const Jobserver &) =delete;
+    Jobserver& operator=(const Jobserver &) =delete;
+
+private:
+    bool join(const char *makeflags);
+    void create(uint32_t jobs);
+
+    bool m_client = false;
+    int m_read_fd = -1; // our own non-blocking description for reading
+    int m_write_fd = -1;
+    std::vector<char> m_tokens; // bytes read, written back as they were
+    std::string m_makeflags;
+};
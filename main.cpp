@@ -1,366 +1,1364 @@
 #include "assert.h"
 #include "build_rules.h"
 #include "job.h"
+#include "executor.h"
+#include "reactor.h"
+#include "trash.h"
+#include "dir_cache.h"
+#include "build_graph.h"
+#include "job_stats.h"
+#include "target_table.h"
+#include "sync_queue.h"
+#include "admission.h"
+#include "jobserver.h"
+#include "autotune.h"
+#include "build_trace.h"
+#include "master_client.h"
+#include "file_hash.h"
 
 #include <cinttypes>
 #include <vector>
 #include <deque>
 #include <string>
-#include <map>
-#include <set>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <chrono>
+
+extern "C" {
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+}
+
+#define JOB_STATS_PATH ".trigger.stats"
+#define BUILD_TRACE_PATH ".trigger.trace"
+#define TRASH_DIR_PREFIX ".trigger.trash"
+#define JOBSERVER_POLL_INTERVAL_MS 10
+// With -j auto, how far above the starting point parallelism may go
+#define AUTOTUNE_MAX_FACTOR 4
+#define BATCH_MAX_RULES 64
+
+// Resolve callbacks get the requested target and the rule building it, or NO_RULE
+typedef std::function<void(TargetId, RuleId)> ResolveCb;
+
+// A blocked want whose input is ready, waiting for its job to get a token back
+struct Resume {
+    RuleId rule_id;
+    std::function<void(void)> done;
+};
 
 class ResolveRequest {
 public:
-    const std::string target;
-    const std::function<void(std::string, const Optional<BuildRule> &)> *const cb;
+    TargetId target;
+    ResolveCb cb;
+    // Rule that declared target as an input, or NO_RULE
+    RuleId consumer;
+    // A running job is waiting for this, directly or transitively
+    bool boosted;
 
-    explicit ResolveRequest(std::string t)
-        : target(t), cb(nullptr) { }
-    ResolveRequest(std::string t, const std::function<void(std::string, const Optional<BuildRule> &)> *f)
-        : target(t), cb(f) { }
+    explicit ResolveRequest(TargetId t)
+        : target(t), cb(nullptr), consumer(NO_RULE), boosted(false) { }
+    ResolveRequest(TargetId t, ResolveCb f, RuleId c = NO_RULE, bool b = false)
+        : target(t), cb(f), consumer(c), boosted(b) { }
 };
 
+#define RULE_LOCK_STRIPES 256
+
+/* Each part of the state has its own synchronization, so that
+ * the reactor serving hook connections, the resolver, the runners and the
+ * build loop only contend when they touch the same thing:
+ *
+ * - targets/target_rules: sharded and lock-free respectively
+ * - graph_mtx: adding rules, edges, bottom levels and durations;
+ *   job_queue_mtx nests inside it when bottom levels move queued rules
+ * - rule_lock(id): a rule's run state and waiters, striped by RuleId
+ * - blocking_mtx: which jobs are blocked and which hold execution tokens
+ * - wait_mtx: the wait-for graph between blocked jobs and rules
+ * - failures_mtx: the failures to report at the end
+ * - sub_jobs, done_jobs: MPMC queues with their own locks
+ * - counters: atomics
+ *
+ * A rule's BuildRule and outputs never change once added, so they can be
+ * read without any lock. */
 struct RunnerState {
 private:
     std::deque<ResolveRequest> resolve_queue;
     std::mutex resolve_mtx;
+    std::condition_variable resolve_cv;
+    bool resolve_stopped = false;
+
+    std::mutex rule_mtxs[RULE_LOCK_STRIPES];
+
+    std::mutex work_mtx;
+    std::condition_variable work_cv;
+    std::atomic<uint64_t> work_events;
 
 public:
-    std::deque<BuildRule> job_queue;
-    std::map<std::string, Optional<BuildRule>> rules_cache;
-    std::deque<std::pair<BuildRule, std::function<void(void)> > > sub_jobs;
-    std::map<BuildRule, Job*> active_jobs;
-    std::deque<Job *> done_jobs;
-    std::map<BuildRule, Outcome> outcomes;
-    std::mutex mtx;
-    uint64_t jobs_started = 0;
-    uint64_t jobs_finished = 0;
-
-    bool has_work() {
-        TIMEIT(std::unique_lock<std::mutex> lck (this->mtx));
-        return (this->jobs_started > this->jobs_finished)
-            || this->resolve_has_items()
-            || (this->sub_jobs.size() > 0)
-            || (this->active_jobs.size() > 0)
-            || (this->done_jobs.size() > 0)
-            || (this->job_queue.size() > 0);
-    }
-
-    void resolve_enqueue(std::string target,
-                         const std::function<void(std::string, const Optional<BuildRule> &)> *cb) {
-        const ResolveRequest req(target, cb);
+    SymbolTable targets;
+    TargetTable target_rules;
+    BuildGraph graph;
+    std::mutex graph_mtx;
+    JobQueue job_queue;
+    std::mutex job_queue_mtx;
+    JobStats *stats = nullptr;
+    uint64_t default_duration_us = 0;
+    RuleStats default_usage; // for rules without recorded usage
+    AdmissionControl *admission = nullptr;
+    SyncQueue<RuleId> sub_jobs; // rules that a running job is blocked on
+    SyncQueue<Resume> resumes;
+    SyncQueue<Job *> done_jobs;
+    std::atomic<uint64_t> jobs_started;
+    std::atomic<uint64_t> jobs_finished;
+    // Jobs holding an execution token: running and not blocked in a want
+    std::atomic<uint32_t> active_jobs;
+    // Jobs handed to the executor and not yet returned, blocked or not
+    std::atomic<uint32_t> jobs_in_flight;
+    uint32_t peak_jobs_in_flight = 0; // only touched by the build loop
+    std::mutex blocking_mtx;
+    std::mutex wait_mtx;
+    std::atomic<uint64_t> blocked_us; // summed over all jobs
+    std::atomic<uint64_t> boosted_rules; // moved ahead for blocked jobs
+    // Rules that took less than this last time run batched, 0 to never batch
+    uint64_t batch_threshold_us = 0;
+    std::atomic<uint64_t> batched_rules;
+    std::atomic<uint64_t> batches;
+    std::atomic<uint64_t> learned_prebuilds; // inputs prebuilt from previous builds' wants
+    std::atomic<uint64_t> stalls_avoided; // wants of prebuilt inputs that found them done
+    std::atomic<uint64_t> stalls; // wants that had to wait for the input to build
+    std::atomic<uint64_t> rules_up_to_date; // not run thanks to early cutoff
+    std::atomic<uint64_t> early_output_wants; // went on before the rule making the output was done
+    // Every queued resolve, queued or dispatched rule and finished job not
+    // yet reaped holds one count, and releases it only after queueing any
+    // follow-up work, so zero means the build is over
+    std::atomic<uint64_t> outstanding;
+    Executor *executor = nullptr;
+    // With keep_going a failure only fails the rules that need its
+    // outputs; otherwise the first one cancels the build
+    bool keep_going = false;
+    // Only the requested targets and what their commands want get built.
+    // Declared and learned inputs are still resolved, to report what was
+    // skipped, but nothing queues them.
+    bool lazy = false;
+    std::atomic<bool> cancelled;
+    std::atomic<uint64_t> jobs_killed; // by cancelling the build
+    std::mutex failures_mtx;
+    std::vector<std::pair<RuleId, std::string> > failures;
+
+    RunnerState()
+        : work_events(0), jobs_started(0), jobs_finished(0), active_jobs(0), jobs_in_flight(0)
+        , blocked_us(0), boosted_rules(0), batched_rules(0), batches(0), learned_prebuilds(0), stalls_avoided(0), stalls(0), rules_up_to_date(0), early_output_wants(0), outstanding(0)
+        , cancelled(false), jobs_killed(0) { }
+
+    std::mutex &rule_lock(RuleId rule_id) {
+        return this->rule_mtxs[rule_id % RULE_LOCK_STRIPES];
+    }
+
+    // Wakes the build loop; called whenever sub_jobs, job_queue, done_jobs
+    // or the counters change
+    void notify_work() {
+        this->work_events++;
+        TIMEIT(std::unique_lock<std::mutex> lck (this->work_mtx));
+        this->work_cv.notify_all();
+    }
+
+    uint64_t get_work_events() const { return this->work_events; }
+
+    void wait_for_work(uint64_t seen_events) {
+        TIMEIT(std::unique_lock<std::mutex> lck (this->work_mtx));
+        while (this->work_events == seen_events) {
+            this->work_cv.wait(lck);
+        }
+    }
+
+    // Also returns once the timeout passes, for conditions nobody signals
+    void wait_for_work(uint64_t seen_events, std::chrono::milliseconds timeout) {
+        TIMEIT(std::unique_lock<std::mutex> lck (this->work_mtx));
+        this->work_cv.wait_for(lck, timeout, [this, seen_events]() { return this->work_events != seen_events; });
+    }
+
+    // A want of rule_id's job is about to wait for an input. The job's
+    // executor worker stays parked until the job goes on after its last
+    // blocked want, so the executor gets a spare for it meanwhile.
+    void block_job(RuleId rule_id) {
+        RuleNode &node = this->graph.node(rule_id);
+        TIMEIT(std::unique_lock<std::mutex> lck (this->blocking_mtx));
+        const bool first = (node.blocked_wants++ == 0);
+        if (first) node.blocked_since = std::chrono::steady_clock::now();
+        const bool held_token = node.holds_token;
+        node.holds_token = false;
+        lck.unlock();
+        if (first) this->executor->begin_blocking();
+        if (!held_token) return;
+        // Its cores go with the token; its memory stays in use
+        this->admission->release_cores(node.admitted_cores_milli);
+        this->active_jobs--;
+        this->notify_work();
+    }
+
+    // The input a want waited for is ready. The want continues right away
+    // if its job still holds a token, otherwise once the build loop hands
+    // one back to it. While other wants of the job still wait, it goes on
+    // without one: the job mostly waits for those too, and taking a token
+    // back for it could leave none to build what they wait for.
+    void unblock_job(RuleId rule_id, std::function<void(void)> done) {
+        RuleNode &node = this->graph.node(rule_id);
+        TIMEIT(std::unique_lock<std::mutex> lck (this->blocking_mtx));
+        ASSERT(node.blocked_wants > 0);
+        const bool last = (--node.blocked_wants == 0);
+        if (last) {
+            const uint64_t blocked_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - node.blocked_since).count();
+            node.blocked_us += blocked_us;
+            this->blocked_us += blocked_us;
+        }
+        const bool go_on = node.holds_token || (node.blocked_wants > 0);
+        lck.unlock();
+        if (last) {
+            // The spare stays until the job has a token to go on with
+            Executor *const executor = this->executor;
+            const std::function<void(void)> resume = done;
+            done = [executor, resume]() {
+                executor->end_blocking();
+                resume();
+            };
+        }
+        if (go_on) {
+            done();
+            return;
+        }
+        this->resumes.push(Resume { rule_id, done });
+        this->notify_work();
+    }
+
+    // Notes how far into its run consumer's job was when it wanted one
+    // of rule_id's outputs
+    void record_want_point(RuleId consumer, RuleId rule_id) {
+        RuleNode &node = this->graph.node(consumer);
+        const auto now = std::chrono::steady_clock::now();
+        TIMEIT(std::unique_lock<std::mutex> lck (this->blocking_mtx));
+        uint64_t blocked_us = node.blocked_us;
+        if (node.blocked_wants > 0) {
+            blocked_us += std::chrono::duration_cast<std::chrono::microseconds>(now - node.blocked_since).count();
+        }
+        const uint64_t elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(now - node.started_at).count();
+        node.want_points.push_back(std::make_pair(elapsed_us - std::min(elapsed_us, blocked_us), rule_id));
+    }
+
+    // Records that consumer's job waits for rule to build target. If rule
+    // transitively waits for consumer, nothing can ever finish: returns
+    // false and the cycle as (waiting rule, wanted target) edges, starting
+    // with the new one.
+    bool add_wait(RuleId consumer, RuleId rule_id, TargetId target,
+                  std::vector<std::pair<RuleId, TargetId> > &out_cycle) {
+        TIMEIT(std::unique_lock<std::mutex> lck (this->wait_mtx));
+        // Depth-first from rule_id, remembering how each rule was reached
+        std::map<RuleId, std::pair<RuleId, TargetId> > reached_from;
+        std::vector<RuleId> stack;
+        stack.push_back(rule_id);
+        reached_from[rule_id] = std::make_pair(consumer, target);
+        while (stack.size() > 0) {
+            const RuleId id = stack.back();
+            stack.pop_back();
+            if (id == consumer) {
+                for (RuleId cur = consumer; ; ) {
+                    const std::pair<RuleId, TargetId> from = reached_from[cur];
+                    out_cycle.push_back(from);
+                    cur = from.first;
+                    if (cur == consumer) break;
+                }
+                std::reverse(out_cycle.begin(), out_cycle.end());
+                return false;
+            }
+            for (auto &edge : this->graph.node(id).waiting_on) {
+                if (reached_from.count(edge.first) > 0) continue;
+                reached_from[edge.first] = std::make_pair(id, edge.second);
+                stack.push_back(edge.first);
+            }
+        }
+        this->graph.node(consumer).waiting_on.push_back(std::make_pair(rule_id, target));
+        return true;
+    }
+
+    void remove_wait(RuleId consumer, RuleId rule_id) {
+        TIMEIT(std::unique_lock<std::mutex> lck (this->wait_mtx));
+        auto &waiting_on = this->graph.node(consumer).waiting_on;
+        for (auto it = waiting_on.begin(); it != waiting_on.end(); ++it) {
+            if (it->first != rule_id) continue;
+            waiting_on.erase(it);
+            return;
+        }
+        PANIC("No such wait");
+    }
+
+    bool is_failed(RuleId rule_id) {
+        TIMEIT(std::unique_lock<std::mutex> lck (this->rule_lock(rule_id)));
+        return this->graph.node(rule_id).failed;
+    }
+
+    // Marks the rule failed and kills its job if it is running. Must be
+    // called without any rule lock held.
+    void fail(RuleId rule_id, const std::string &reason) {
+        RuleNode &node = this->graph.node(rule_id);
+        {
+            TIMEIT(std::unique_lock<std::mutex> lck (this->rule_lock(rule_id)));
+            if (node.failed) return;
+            node.failed = true;
+            if (node.job != nullptr) node.job->cancel();
+        }
+        if (!this->cancelled) {
+            // Jobs killed by the cancellation are not failures of their own
+            TIMEIT(std::unique_lock<std::mutex> lck (this->failures_mtx));
+            this->failures.push_back(std::make_pair(rule_id, reason));
+        }
+        if (!this->keep_going) this->cancel();
+    }
+
+    // Kills every running job and releases every job blocked on a rule
+    // that has not started; nothing starts after this. Must be called
+    // without any rule lock held.
+    void cancel() {
+        if (this->cancelled.exchange(true)) return;
+        std::vector<std::function<void(void)> > waiters;
+        // The resolver may be adding rules meanwhile; the ones counted here
+        // are fully in place, and it is let go before any rule lock
+        uint32_t rules_count;
+        {
+            TIMEIT(std::unique_lock<std::mutex> graph_lck (this->graph_mtx));
+            rules_count = this->graph.size();
+        }
+        for (RuleId rule_id = 0; rule_id < rules_count; rule_id++) {
+            RuleNode &node = this->graph.node(rule_id);
+            TIMEIT(std::unique_lock<std::mutex> lck (this->rule_lock(rule_id)));
+            switch (node.state) {
+            case RuleState::Running:
+                if (node.failed) break; // killed already, or what failed
+                node.failed = true;
+                node.job->cancel();
+                this->jobs_killed++;
+                break;
+            case RuleState::Idle:
+                if (node.waiters.size() + node.output_waiters.size() == 0) break;
+                node.failed = true;
+                node.state = RuleState::Failed;
+                waiters.insert(waiters.end(), node.waiters.begin(), node.waiters.end());
+                node.waiters.clear();
+                for (auto &waiter : node.output_waiters) waiters.push_back(waiter.second);
+                node.output_waiters.clear();
+                break;
+            case RuleState::Done: break;
+            case RuleState::Failed: break;
+            }
+        }
+        // Rules added since then see the flag under their lock
+        this->notify_work();
+        for (auto &waiter : waiters) waiter();
+    }
+
+    // Called by the build loop once it accounted a token for the resume
+    void grant_resume(const Resume &resume) {
+        RuleNode &node = this->graph.node(resume.rule_id);
+        TIMEIT(std::unique_lock<std::mutex> lck (this->blocking_mtx));
+        if (node.holds_token) {
+            // Another want of the same job got the token back first
+            this->active_jobs--;
+        } else {
+            node.holds_token = true;
+            this->admission->readmit_cores(node.admitted_cores_milli);
+        }
+        lck.unlock();
+        resume.done();
+    }
+
+    void add_outstanding() { this->outstanding++; }
+
+    void release_outstanding() {
+        ASSERT(this->outstanding > 0);
+        if (--this->outstanding == 0) this->notify_work();
+    }
+
+    bool has_work() const {
+        return this->outstanding > 0;
+    }
+
+    // Boosted requests go ahead of the eagerly queued ones
+    void resolve_enqueue(TargetId target, ResolveCb cb, RuleId consumer = NO_RULE, bool boosted = false) {
+        const ResolveRequest req(target, cb, consumer, boosted);
         if (this->resolve_lookup_cache(req)) return;
+        this->add_outstanding();
         TIMEIT(std::unique_lock<std::mutex> lck (this->resolve_mtx));
-        this->resolve_queue.push_back(req);
+        if (boosted) {
+            this->resolve_queue.push_front(req);
+        } else {
+            this->resolve_queue.push_back(req);
+        }
+        this->resolve_cv.notify_one();
     }
 
+    // Blocks until a request is available; returns none once resolve_stop() was called.
+    // Each request returned holds an outstanding count until resolve_done().
     Optional<ResolveRequest> resolve_dequeue() {
         TIMEIT(std::unique_lock<std::mutex> lck (this->resolve_mtx));
-        if (this->resolve_queue.size() == 0) return Optional<ResolveRequest>();
+        while (this->resolve_queue.size() == 0) {
+            if (this->resolve_stopped) return Optional<ResolveRequest>();
+            this->resolve_cv.wait(lck);
+        }
         auto req = this->resolve_queue.front();
         this->resolve_queue.pop_front();
         return Optional<ResolveRequest>(req);
     }
 
-    bool resolve_lookup_cache(const ResolveRequest &req) {
+    void resolve_done() {
+        this->release_outstanding();
+    }
+
+    void resolve_stop() {
         TIMEIT(std::unique_lock<std::mutex> lck (this->resolve_mtx));
-        auto cached = this->rules_cache.find(req.target);
-        if (cached == this->rules_cache.end()) return false;
-        auto found_rule = cached->second;
-        DEBUG("(cached) Invoking callback on: " << (found_rule.has_value() ? found_rule.get_value().to_string() : "<none>"));
-        if (req.cb) (*req.cb)(req.target, found_rule);
+        this->resolve_stopped = true;
+        this->resolve_cv.notify_all();
+    }
+
+    // Records the query result for target and, for a rule, all its outputs,
+    // so that sibling outputs are answered from the cache
+    void resolve_cache_put(TargetId target, RuleId rule_id, const std::vector<TargetId> &outputs) {
+        this->target_rules.set(target, rule_id);
+        for (auto output : outputs) {
+            this->target_rules.set_if_unresolved(output, rule_id);
+        }
+    }
+
+    RuleId resolve_cache_get(TargetId target) {
+        return this->target_rules.get(target);
+    }
+
+    bool resolve_lookup_cache(const ResolveRequest &req) {
+        const RuleId found_rule = this->target_rules.get(req.target);
+        if (found_rule == UNRESOLVED_TARGET) return false;
+        if ((found_rule != NO_RULE) && (req.consumer != NO_RULE)) {
+            this->add_graph_edge(found_rule, req.consumer);
+        }
+        DEBUG("(cached) Invoking callback on: " << this->targets.name(req.target));
+        if (req.cb) req.cb(req.target, found_rule);
         return true;
     }
 
-    bool resolve_has_items() {
-        TIMEIT(std::unique_lock<std::mutex> lck (this->resolve_mtx));
-        return (this->resolve_queue.size() > 0);
+    void add_graph_edge(RuleId input, RuleId consumer) {
+        TIMEIT(std::unique_lock<std::mutex> lck (this->graph_mtx));
+        const std::vector<RuleId> raised = this->graph.add_edge(input, consumer);
+        TIMEIT(std::unique_lock<std::mutex> queue_lck (this->job_queue_mtx));
+        for (auto raised_id : raised) {
+            this->job_queue.update(raised_id, this->graph.node(raised_id).bottom_level_us);
+        }
+        // Inputs discovered after their consumer was boosted inherit it
+        if (this->job_queue.is_boosted(consumer)) this->boost_locked(input);
+    }
+
+    // Whether the rule is small enough to batch and all its known inputs
+    // are built, so it should not block. Called with graph_mtx held.
+    bool batchable_locked(RuleId rule_id) {
+        const RuleNode &node = this->graph.node(rule_id);
+        if ((this->batch_threshold_us == 0) || !node.duration_known) return false;
+        if (node.duration_us >= this->batch_threshold_us) return false;
+        for (auto input : node.inputs) {
+            TIMEIT(std::unique_lock<std::mutex> lck (this->rule_lock(input)));
+            if (this->graph.node(input).state != RuleState::Done) return false;
+        }
+        return true;
+    }
+
+    // Moves the rule and everything it transitively depends on ahead in
+    // the job queue, because a running job is waiting for it
+    void boost(RuleId rule_id) {
+        TIMEIT(std::unique_lock<std::mutex> lck (this->graph_mtx));
+        TIMEIT(std::unique_lock<std::mutex> queue_lck (this->job_queue_mtx));
+        this->boost_locked(rule_id);
+    }
+
+    // Called with graph_mtx and job_queue_mtx held
+    void boost_locked(RuleId rule_id) {
+        std::vector<RuleId> stack;
+        stack.push_back(rule_id);
+        while (stack.size() > 0) {
+            const RuleId id = stack.back();
+            stack.pop_back();
+            // Already boosted rules had their inputs boosted too
+            if (!this->job_queue.boost(id)) continue;
+            this->boosted_rules++;
+            for (auto input : this->graph.node(id).inputs) stack.push_back(input);
+        }
     }
 };
 
-static void sub_resolve_done(std::string input UNUSED_ATTR, const Optional<BuildRule> &sub_orule UNUSED_ATTR)
+static ResourceDemand rule_demand(const RuleStats &stats)
 {
-    // if (!sub_orule.has_value()) {
-    //     std::cerr << "ERROR: explicit input has no build rule: '" << input << "'" << std::endl;
-    //     exit(1);
-    // }
+    ResourceDemand demand;
+    demand.rss_kb = stats.peak_rss_kb;
+    if (stats.usage_duration_us > 0) {
+        const uint64_t cores_milli = stats.cpu_us * 1000 / stats.usage_duration_us;
+        demand.cores_milli = (cores_milli > UINT32_MAX) ? UINT32_MAX : (uint32_t)cores_milli;
+    }
+    return demand;
 }
 
-const std::function<void(std::string, const Optional<BuildRule> &)> sub_resolve_done_fn(sub_resolve_done);
-
 void resolve_all(BuildRules &build_rules,
                  RunnerState &runner_state,
                  const ResolveRequest &req)
 {
     if (runner_state.resolve_lookup_cache(req)) return;
-    DEBUG("Resolving: " << req.target);
-    const Optional<BuildRule> orule = build_rules.query(req.target);
-    DEBUG("Done Resolving: " << req.target);
+    const char *const target_name = runner_state.targets.name(req.target);
+    DEBUG("Resolving: " << target_name);
+    const Optional<BuildRule> orule = build_rules.query(target_name);
+    DEBUG("Done Resolving: " << target_name);
 
-    {
-        TIMEIT(std::unique_lock<std::mutex> lck (runner_state.mtx));
-        runner_state.rules_cache[req.target] = orule;
-        if (orule.has_value()) {
-            const BuildRule &rule = orule.get_value();
-            for (auto input : rule.inputs) {
-                runner_state.resolve_enqueue(input, &sub_resolve_done_fn);
+    if (!orule.has_value()) {
+        runner_state.resolve_cache_put(req.target, NO_RULE, std::vector<TargetId>());
+        if (req.cb) req.cb(req.target, NO_RULE);
+        return;
+    }
+
+    const BuildRule &rule = orule.get_value();
+    std::vector<TargetId> outputs;
+    RuleId rule_id = NO_RULE;
+    for (auto &output : rule.outputs) {
+        const TargetId output_id = runner_state.targets.intern(output);
+        outputs.push_back(output_id);
+        // A target that is not among its rule's own outputs can bring in a
+        // rule that is already known under its real outputs
+        const RuleId known = runner_state.resolve_cache_get(output_id);
+        if ((known != UNRESOLVED_TARGET) && (known != NO_RULE)) rule_id = known;
+    }
+
+    const bool is_new = (rule_id == NO_RULE);
+    if (is_new) {
+        const Optional<RuleStats> stats = runner_state.stats->get(rule.to_string());
+        // Whatever the commands asked for last time is likely to be asked
+        // for again, so treat it like a declared input
+        std::vector<TargetId> learned_inputs;
+        if (stats.has_value()) {
+            for (auto &want : stats.get_value().wants) {
+                learned_inputs.push_back(runner_state.targets.intern(want));
             }
-            runner_state.job_queue.push_back(rule);
         }
+        TIMEIT(std::unique_lock<std::mutex> lck (runner_state.graph_mtx));
+        const bool duration_known = stats.has_value() && (stats.get_value().duration_us > 0);
+        rule_id = runner_state.graph.add_rule(
+            rule, outputs, duration_known ? stats.get_value().duration_us : runner_state.default_duration_us);
+        runner_state.graph.node(rule_id).duration_known = duration_known;
+        runner_state.graph.node(rule_id).learned_inputs.swap(learned_inputs);
+        runner_state.graph.node(rule_id).demand = rule_demand(
+            (stats.has_value() && (stats.get_value().peak_rss_kb > 0)) ? stats.get_value() : runner_state.default_usage);
     }
+    runner_state.resolve_cache_put(req.target, rule_id, outputs);
 
-    DEBUG("Invoking callback on: " << (orule.has_value() ? orule.get_value().to_string() : "<none>"));
-    if (req.cb) (*req.cb)(req.target, orule);
+    if (req.consumer != NO_RULE) {
+        runner_state.add_graph_edge(rule_id, req.consumer);
+    }
+    if (is_new) {
+        // A rule a running job waits for is boosted, and so are its inputs
+        if (req.boosted) runner_state.boost(rule_id);
+        for (auto &input : rule.inputs) {
+            runner_state.resolve_enqueue(runner_state.targets.intern(input), nullptr, rule_id, req.boosted);
+        }
+        for (auto input : runner_state.graph.node(rule_id).learned_inputs) {
+            if (!runner_state.lazy) runner_state.learned_prebuilds++;
+            runner_state.resolve_enqueue(input, nullptr, rule_id, req.boosted);
+        }
+    }
+    // Requested targets and wants come without a consumer; a want also
+    // schedules the rule itself once it waits for it
+    if (is_new && (!runner_state.lazy || (req.consumer == NO_RULE))) {
+        runner_state.add_outstanding();
+        {
+            TIMEIT(std::unique_lock<std::mutex> lck (runner_state.graph_mtx));
+            TIMEIT(std::unique_lock<std::mutex> queue_lck (runner_state.job_queue_mtx));
+            runner_state.job_queue.push(rule_id, runner_state.graph.node(rule_id).bottom_level_us);
+        }
+        runner_state.notify_work();
+    }
+
+    DEBUG("Invoking callback on: " << rule.to_string());
+    if (req.cb) req.cb(req.target, rule_id);
 }
 
 static void done_handler(RunnerState *runner_state, std::function<void(void)> done,
-                         std::string input,
-                         const Optional<BuildRule> &rule);
+                         RuleId consumer, TargetId input, RuleId rule_id);
 
-static bool run_job(const BuildRule &rule,
-                    RunnerState &runner_state)
+// A running rule with early outputs closed one of them: whoever waits for
+// it need not wait for the rest of the rule
+static void output_closed(RunnerState &runner_state, RuleId rule_id, TargetId output)
 {
-    // 1. execute command
-    // 2. all forks/execs done by this command are allowed in parallel
-    // 3. at most one resolution of a command's input is run in parallel,
-    //    any more are put on the queue
-
-    TIMEIT(std::unique_lock<std::mutex> lck (runner_state.mtx));
-
-    if (runner_state.active_jobs.find(rule) != runner_state.active_jobs.end()) {
-        return false;
+    RuleNode &node = runner_state.graph.node(rule_id);
+    std::vector<std::function<void(void)> > output_waiters;
+    {
+        TIMEIT(std::unique_lock<std::mutex> lck (runner_state.rule_lock(rule_id)));
+        if ((node.state != RuleState::Running) || node.failed) return;
+        if (std::find(node.closed_outputs.begin(), node.closed_outputs.end(), output) == node.closed_outputs.end()) {
+            node.closed_outputs.push_back(output);
+        }
+        auto it = node.output_waiters.begin();
+        while (it != node.output_waiters.end()) {
+            if (it->first != output) {
+                ++it;
+                continue;
+            }
+            output_waiters.push_back(it->second);
+            it = node.output_waiters.erase(it);
+        }
+    }
+    DEBUG("[EARLY] " << runner_state.targets.name(output));
+    runner_state.early_output_wants += output_waiters.size();
+    for (auto &waiter : output_waiters) {
+        waiter();
     }
+}
 
-    if (runner_state.outcomes.find(rule) != runner_state.outcomes.end()) {
-        return true;
+// Claims an idle rule and creates its job, which takes over the caller's
+// token and the cores admitted with it. Returns null if the rule is
+// already running or done.
+static Job *start_job(RuleId rule_id, RunnerState &runner_state, uint32_t admitted_cores_milli)
+{
+    RuleNode &node = runner_state.graph.node(rule_id);
+    TIMEIT(std::unique_lock<std::mutex> lck (runner_state.rule_lock(rule_id)));
+    switch (node.state) {
+    case RuleState::Running: return nullptr;
+    case RuleState::Done: return nullptr;
+    case RuleState::Failed: return nullptr;
+    case RuleState::Idle: break;
     }
+    if (runner_state.cancelled) return nullptr;
 
+    const BuildRule &rule = node.rule;
     DEBUG("Running: " << rule.to_string());
 
-    auto resolve_cb = [rule, &runner_state](std::string input, std::function<void(void)> done) {
+    auto resolve_cb = [&runner_state, rule_id](std::string input, std::function<void(void)> done) {
         DEBUG("resolve cb: " << input);
-        auto f = new std::function<void(std::string, const Optional<BuildRule> &)>(
-            std::bind(&done_handler, &runner_state, done, std::placeholders::_1, std::placeholders::_2));
-        runner_state.resolve_enqueue(input, f);
+        runner_state.resolve_enqueue(
+            runner_state.targets.intern(input),
+            std::bind(&done_handler, &runner_state, done, rule_id, std::placeholders::_1, std::placeholders::_2),
+            NO_RULE, true);
+    };
+
+    auto output_closed_cb = [&runner_state, rule_id](std::string output) {
+        output_closed(runner_state, rule_id, runner_state.targets.intern(output));
     };
 
-    Job *const job = new Job(rule, resolve_cb);
-    runner_state.active_jobs[rule] = job;
+    {
+        TIMEIT(std::unique_lock<std::mutex> blocking_lck (runner_state.blocking_mtx));
+        node.holds_token = true;
+        node.admitted_cores_milli = admitted_cores_milli;
+        node.started_at = std::chrono::steady_clock::now();
+    }
+    Job *const job = new Job(rule, resolve_cb, output_closed_cb);
+    node.state = RuleState::Running;
+    node.job = job;
     DEBUG("Added " << rule.to_string() << " with job " << job);
     runner_state.jobs_started++;
+    return job;
+}
+
+static bool same_hash(const std::string &path, const std::string &last_hash)
+{
+    if (last_hash == UNREADABLE_HASH) return false;
+    return file_hash(path) == last_hash;
+}
+
+// Early cutoff: the rule need not run if its commands and every file it
+// read are as they were after its last successful run, and its outputs
+// are as that run left them. The inputs other rules generate are built
+// first, so one that was rebuilt with the same content does not make
+// its consumers run again.
+static bool up_to_date(RuleId rule_id, RunnerState &runner_state, Job &job)
+{
+    const BuildRule &rule = job.get_rule();
+    const Optional<RuleStats> stats = runner_state.stats->get(rule.to_string());
+    if (!stats.has_value() || (stats.get_value().output_hashes.size() == 0)) return false;
+    const RuleStats &last = stats.get_value();
+    if (last.command_hash != data_hash(job.command())) return false;
+    // Checking the outputs first needs nothing built
+    for (auto &hash : last.output_hashes) {
+        if (!same_hash(hash.first, hash.second)) return false;
+    }
+    std::vector<std::string> inputs;
+    for (auto &hash : last.input_hashes) inputs.push_back(hash.first);
+    job.want_all(inputs);
+    if (runner_state.is_failed(rule_id)) return false;
+    for (auto &hash : last.input_hashes) {
+        if (!same_hash(hash.first, hash.second)) return false;
+    }
+    PRINT("[CLEAN] " << rule.outputs.front());
+    runner_state.rules_up_to_date++;
+    return true;
+}
+
+static void record_hashes(RunnerState &runner_state, const Job &job)
+{
+    const BuildRule &rule = job.get_rule();
+    // Declared inputs the commands did not read are not built lazily, and
+    // checking them next time would build them after all
+    std::set<std::string> input_paths;
+    if (!runner_state.lazy) input_paths.insert(rule.inputs.begin(), rule.inputs.end());
+    for (auto &input : job.inputs()) input_paths.insert(input);
+    std::vector<std::pair<std::string, std::string> > input_hashes, output_hashes;
+    for (auto &path : input_paths) input_hashes.push_back(std::make_pair(path, file_hash(path)));
+    for (auto &path : rule.outputs) output_hashes.push_back(std::make_pair(path, file_hash(path)));
+    runner_state.stats->record_hashes(rule.to_string(), data_hash(job.command()), input_hashes, output_hashes);
+}
+
+// Records how the job went and wakes everyone waiting for the rule.
+// Returns whether the job still held its token; with keep_token it is
+// left to the caller, otherwise given back. A job that was not executed
+// leaves the rule's stats from its last run alone.
+static bool finish_job(RuleId rule_id, RunnerState &runner_state, Job *job, bool executed, bool succeeded,
+                       uint64_t elapsed_us, bool keep_token)
+{
+    if (!succeeded) {
+        runner_state.fail(rule_id, "exited with status " + std::to_string(job->exit_status()));
+    }
+    const bool failed = runner_state.is_failed(rule_id);
+    RuleNode &node = runner_state.graph.node(rule_id);
+    const BuildRule &rule = node.rule;
+    uint64_t duration_us;
+    bool held_token;
+    {
+        TIMEIT(std::unique_lock<std::mutex> blocking_lck (runner_state.blocking_mtx));
+        held_token = node.holds_token;
+        if (held_token && !keep_token) {
+            runner_state.admission->release_cores(node.admitted_cores_milli);
+            runner_state.active_jobs--;
+        }
+        node.holds_token = false;
+        // Time spent waiting for inputs belongs to them, not to this rule
+        duration_us = elapsed_us - std::min(elapsed_us, node.blocked_us);
+    }
+    runner_state.notify_work();
+    DEBUG("Done: '" << rule.to_string() << "' in " << duration_us << " us");
+    // A killed or failing job says little about how the rule usually runs
+    const bool measured = executed && !failed;
+    if (measured) runner_state.stats->record_duration(rule.to_string(), duration_us);
+    if (measured && (job->peak_rss_kb() > 0)) {
+        // Batched jobs share a shell and are not measured on their own
+        runner_state.stats->record_usage(rule.to_string(), job->peak_rss_kb(), job->cpu_us());
+    }
+    if (measured) {
+        std::vector<std::string> wants;
+        TIMEIT(std::unique_lock<std::mutex> wanted_lck (runner_state.rule_lock(rule_id)));
+        for (auto input : node.wanted) wants.push_back(runner_state.targets.name(input));
+        wanted_lck.unlock();
+        runner_state.stats->record_wants(rule.to_string(), wants);
+        record_hashes(runner_state, *job);
+    }
+
+    if (measured) {
+        TIMEIT(std::unique_lock<std::mutex> graph_lck (runner_state.graph_mtx));
+        runner_state.graph.set_duration(rule_id, duration_us);
+    }
+    DEBUG("Done job: " << job);
+    runner_state.add_outstanding();
+    runner_state.done_jobs.push(job);
+
+    TIMEIT(std::unique_lock<std::mutex> lck (runner_state.rule_lock(rule_id)));
+    node.job = nullptr;
+    node.state = node.failed ? RuleState::Failed : RuleState::Done;
+    node.peak_rss_kb = job->peak_rss_kb();
+    node.cpu_us = job->cpu_us();
+    std::vector<std::function<void(void)> > rule_waiters;
+    rule_waiters.swap(node.waiters);
+    for (auto &waiter : node.output_waiters) rule_waiters.push_back(waiter.second);
+    node.output_waiters.clear();
     lck.unlock();
+    runner_state.notify_work();
+
+    for (auto &waiter : rule_waiters) {
+        waiter();
+    }
+    return held_token;
+}
 
-    job->execute();
-    DEBUG("Done: '" << rule.to_string() << "'");
-
-    TIMEIT(lck.lock());
-    auto found_job = runner_state.active_jobs.find(rule);
-    ASSERT(found_job != runner_state.active_jobs.end());
-    runner_state.done_jobs.push_back(found_job->second);
-    auto erased_count = runner_state.active_jobs.erase(rule);
-    ASSERT(1 == erased_count);
-    DEBUG("Done job: " << found_job->second);
-    runner_state.outcomes[rule] = Outcome();
+static uint64_t elapsed_us_since(std::chrono::steady_clock::time_point before)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - before).count();
+}
+
+static bool run_job(RuleId rule_id,
+                    RunnerState &runner_state)
+{
+    // 1. execute command
+    // 2. all forks/execs done by this command are allowed in parallel
+    // 3. at most one resolution of a command's input is run in parallel,
+    //    any more are put on the queue
+
+    // The build loop took a token for us; keep it only if we run the rule
+    const uint32_t admitted_cores_milli = runner_state.graph.node(rule_id).demand.cores_milli;
+    Job *const job = start_job(rule_id, runner_state, admitted_cores_milli);
+    if (job == nullptr) {
+        runner_state.admission->release_cores(admitted_cores_milli);
+        runner_state.active_jobs--;
+        return false;
+    }
+    const auto before = std::chrono::steady_clock::now();
+    // Checking may have failed it, if an input it needs failed
+    const bool execute = !up_to_date(rule_id, runner_state, *job) && !runner_state.is_failed(rule_id);
+    const bool succeeded = execute ? job->execute() : true;
+    finish_job(rule_id, runner_state, job, execute, succeeded, elapsed_us_since(before), false);
     return true;
 }
 
+// Runs the rules one after another in one shell, on a single token
+static void run_batch(const std::vector<RuleId> &rule_ids, RunnerState &runner_state)
+{
+    ShellBatch batch;
+    const uint32_t admitted_cores_milli = runner_state.graph.node(rule_ids.front()).demand.cores_milli;
+    for (auto rule_id : rule_ids) {
+        // Someone blocked on a later rule of the batch may have run it already
+        Job *const job = start_job(rule_id, runner_state, admitted_cores_milli);
+        if (job == nullptr) continue;
+        const auto before = std::chrono::steady_clock::now();
+        const bool execute = !up_to_date(rule_id, runner_state, *job) && !runner_state.is_failed(rule_id);
+        const bool succeeded = execute ? batch.execute(*job) : true;
+        // The job gets the token back before it can finish
+        const bool held_token = finish_job(rule_id, runner_state, job, execute, succeeded, elapsed_us_since(before), true);
+        ASSERT(held_token);
+        if (execute) runner_state.batched_rules++;
+    }
+    runner_state.admission->release_cores(admitted_cores_milli);
+    runner_state.active_jobs--;
+    runner_state.batches++;
+    runner_state.notify_work();
+}
+
 
 static void done_handler(RunnerState *runner_state, std::function<void(void)> done,
-                         std::string input UNUSED_ATTR,
-                         const Optional<BuildRule> &rule)
+                         RuleId consumer, TargetId input, RuleId rule_id)
 {
     // DEBUG("done resolve cb: " << input);
-    if (!rule.has_value()) {
+    if (rule_id == NO_RULE) {
         done();
         return;
     }
-    TIMEIT(std::unique_lock<std::mutex> lck (runner_state->mtx));
-    if (runner_state->outcomes.find(rule.get_value()) != runner_state->outcomes.end()) {
-        DEBUG("done - Found outcome for: " << rule.get_value().outputs.front());
+    runner_state->record_want_point(consumer, rule_id);
+    const RuleNode &consumer_node = runner_state->graph.node(consumer);
+    bool learned = false;
+    for (auto learned_input : consumer_node.learned_inputs) {
+        if (learned_input == input) learned = true;
+    }
+    {
+        // Only generated inputs are remembered for the next build
+        TIMEIT(std::unique_lock<std::mutex> consumer_lck (runner_state->rule_lock(consumer)));
+        RuleNode &mutable_consumer = runner_state->graph.node(consumer);
+        bool known = false;
+        for (auto wanted : mutable_consumer.wanted) {
+            if (wanted == input) known = true;
+        }
+        if (!known) mutable_consumer.wanted.push_back(input);
+    }
+
+    const std::string needs_failed = std::string("needs ") + runner_state->targets.name(input) + ", which failed";
+    RuleNode &node = runner_state->graph.node(rule_id);
+    TIMEIT(std::unique_lock<std::mutex> lck (runner_state->rule_lock(rule_id)));
+    if (node.state == RuleState::Done) {
+        DEBUG("done - Found outcome for: " << node.rule.to_string());
+        lck.unlock();
+        if (learned) runner_state->stalls_avoided++;
         done();
         return;
     }
-    runner_state->sub_jobs.push_back(std::pair<BuildRule, std::function<void(void) > >(rule.get_value(), done));
+    if ((node.state == RuleState::Failed) || runner_state->cancelled) {
+        // The consumer cannot succeed either; let it go so it can be reaped
+        lck.unlock();
+        runner_state->fail(consumer, needs_failed);
+        done();
+        return;
+    }
+    if (std::find(node.closed_outputs.begin(), node.closed_outputs.end(), input) != node.closed_outputs.end()) {
+        lck.unlock();
+        runner_state->early_output_wants++;
+        done();
+        return;
+    }
+    std::vector<std::pair<RuleId, TargetId> > cycle;
+    if (!runner_state->add_wait(consumer, rule_id, input, cycle)) {
+        lck.unlock();
+        // Each job in the cycle is blocked on the next one
+        PRINT("Dependency cycle between running jobs:");
+        for (auto &edge : cycle) {
+            PRINT("\t" << runner_state->graph.node(edge.first).rule.outputs.front()
+                  << " waits for " << runner_state->targets.name(edge.second));
+        }
+        for (auto &edge : cycle) {
+            runner_state->fail(edge.first, std::string("dependency cycle, waits for ") + runner_state->targets.name(edge.second));
+        }
+        done();
+        return;
+    }
+    runner_state->stalls++;
+    // run_job fires the waiters once the rule is done; the first waiter
+    // also makes sure it gets scheduled, unless it is already running.
+    // Meanwhile the consumer's token goes to someone who can use it.
+    runner_state->block_job(consumer);
+    const std::function<void(void)> waiter = [runner_state, consumer, rule_id, needs_failed, done]() {
+            runner_state->remove_wait(consumer, rule_id);
+            if (runner_state->is_failed(rule_id)) runner_state->fail(consumer, needs_failed);
+            runner_state->unblock_job(consumer, done);
+        };
+    if (node.rule.early_outputs) {
+        node.output_waiters.push_back(std::make_pair(input, waiter));
+    } else {
+        node.waiters.push_back(waiter);
+    }
+    const bool schedule = (node.waiters.size() + node.output_waiters.size() == 1) && (node.state != RuleState::Running);
+    lck.unlock();
+    // Its own inputs may still be queued behind work nobody waits for
+    runner_state->boost(rule_id);
+    if (schedule) {
+        runner_state->add_outstanding();
+        runner_state->sub_jobs.push(rule_id);
+        runner_state->notify_work();
+    }
+}
+
+static void print_schedule_report(const BuildGraph &graph, uint32_t workers, uint64_t actual_us)
+{
+    // Both estimates replay this build's measured durations on the same graph
+    const uint64_t fifo_us = estimate_makespan_us(graph, SchedulePolicy::Fifo, workers);
+    const uint64_t critical_path_us = estimate_makespan_us(graph, SchedulePolicy::CriticalPath, workers);
+    PRINT("Schedule (" << graph.size() << " rules, -j " << workers << "): "
+          << "actual " << (actual_us / 1000) << " ms, "
+          << "estimated FIFO " << (fifo_us / 1000) << " ms, "
+          << "estimated critical-path " << (critical_path_us / 1000) << " ms");
 }
 
-constexpr const uint32_t max_concurrent_jobs = 4;
+// Everything the scheduler knew by the end of the build, for replaying
+// it offline with other policies
+static void save_trace(RunnerState &runner_state, uint32_t jobs, uint64_t makespan_us)
+{
+    BuildTrace trace;
+    trace.jobs = jobs;
+    trace.makespan_us = makespan_us;
+    const uint32_t rules_count = runner_state.graph.size();
+    for (RuleId rule_id = 0; rule_id < rules_count; rule_id++) {
+        const RuleNode &node = runner_state.graph.node(rule_id);
+        TraceRule rule;
+        rule.name = node.rule.to_string();
+        rule.duration_us = node.duration_us;
+        rule.peak_rss_kb = node.peak_rss_kb;
+        rule.cpu_us = node.cpu_us;
+        rule.inputs.assign(node.inputs.begin(), node.inputs.end());
+        {
+            TIMEIT(std::unique_lock<std::mutex> lck (runner_state.blocking_mtx));
+            rule.wants.assign(node.want_points.begin(), node.want_points.end());
+        }
+        std::sort(rule.wants.begin(), rule.wants.end());
+        trace.rules.push_back(rule);
+    }
+    trace.save(BUILD_TRACE_PATH);
+}
 
-void build(BuildRules &build_rules, const std::vector<std::string> &targets)
+static void print_failures(RunnerState &runner_state)
 {
+    TIMEIT(std::unique_lock<std::mutex> lck (runner_state.failures_mtx));
+    if (runner_state.failures.size() > 0) {
+        PRINT("BUILD FAILED: " << runner_state.failures.size() << " rules failed:");
+    }
+    for (auto &failure : runner_state.failures) {
+        PRINT("\t" << runner_state.graph.node(failure.first).rule.outputs.front() << ": " << failure.second);
+    }
+    if (runner_state.jobs_killed > 0) {
+        PRINT("Killed " << runner_state.jobs_killed << " running jobs");
+    }
+}
+
+// What building only on demand left out of the declared closure
+static void print_lazy_report(RunnerState &runner_state)
+{
+    const uint32_t rules_count = runner_state.graph.size();
+    uint32_t skipped = 0, unmeasured = 0;
+    uint64_t skipped_us = 0;
+    for (RuleId rule_id = 0; rule_id < rules_count; rule_id++) {
+        const RuleNode &node = runner_state.graph.node(rule_id);
+        TIMEIT(std::unique_lock<std::mutex> lck (runner_state.rule_lock(rule_id)));
+        if (node.state != RuleState::Idle) continue;
+        skipped++;
+        skipped_us += node.duration_us;
+        if (!node.duration_known) unmeasured++;
+    }
+    PRINT("Lazy: started " << (rules_count - skipped) << " of " << rules_count << " rules in the declared closure, "
+          << "skipped " << skipped << " never wanted, about " << (skipped_us / 1000) << " ms of work"
+          << ((unmeasured > 0) ? " (" + std::to_string(unmeasured) + " of them guessed)" : std::string()));
+}
+
+// Returns whether everything was built
+bool build(BuildRules &build_rules, const std::vector<std::string> &targets,
+           uint32_t max_concurrent_jobs, bool autotune, uint32_t max_jobs_in_flight, uint64_t memory_budget_kb,
+           uint64_t batch_threshold_us, bool keep_going, bool lazy)
+{
+    const auto build_start = std::chrono::steady_clock::now();
+    JobStats stats(JOB_STATS_PATH);
+    stats.load();
+
     RunnerState runner_state;
+    runner_state.stats = &stats;
+    runner_state.default_duration_us = stats.default_duration_us();
+    runner_state.default_usage = stats.default_usage();
+    runner_state.batch_threshold_us = batch_threshold_us;
+    runner_state.keep_going = keep_going;
+    runner_state.lazy = lazy;
+    // Each job the limit lets run gets a core's worth
+    AdmissionControl admission(memory_budget_kb, max_concurrent_jobs * 1000);
+    runner_state.admission = &admission;
 
-    std::vector<std::string> missing_rules;
+    std::vector<TargetId> missing_rules;
     for (auto target : targets) {
         DEBUG("Enqueing: " << target);
-        std::function<void(std::string, const Optional<BuildRule> &)> handler =
-            [&missing_rules]
-            (std::string input, const Optional<BuildRule> &rule){
-            if (!rule.has_value()) {
+        const ResolveCb handler = [&missing_rules](TargetId input, RuleId rule_id) {
+            if (rule_id == NO_RULE) {
                 missing_rules.push_back(input);
             }
         };
-        resolve_all(build_rules, runner_state, ResolveRequest(target, &handler));
+        resolve_all(build_rules, runner_state, ResolveRequest(runner_state.targets.intern(target), handler));
     }
 
     if (missing_rules.size() > 0) {
         for (auto m : missing_rules) {
-            PRINT("Failed to resolve: " << m);
+            PRINT("Failed to resolve: " << runner_state.targets.name(m));
         }
         exit(1);
     }
 
-    bool shutdown = false;
-    const uint32_t runners_count = 4;
-    struct ThreadInfo {
-        std::thread *thread;
-        Optional<BuildRule> o_rule;
-        std::mutex mutex;
-        std::condition_variable cv;
-        bool shutting_down;
-    };
+    // Interrupting the build cancels it like a failure would. The
+    // signals are handled by a thread of ours, so every thread started
+    // from here on blocks them; commands get them unblocked.
+    sigset_t cancel_signals;
+    sigemptyset(&cancel_signals);
+    sigaddset(&cancel_signals, SIGINT);
+    sigaddset(&cancel_signals, SIGTERM);
+    sigaddset(&cancel_signals, SIGHUP);
+    ASSERT(0 == pthread_sigmask(SIG_BLOCK, &cancel_signals, NULL));
+    // Without pidfds the reactor reaps commands through a signalfd, which
+    // only sees SIGCHLD if no thread takes it
+    sigset_t child_signal;
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    ASSERT(0 == pthread_sigmask(SIG_BLOCK, &child_signal, NULL));
+    std::atomic<bool> interrupted(false), signals_done(false);
+    std::thread signal_th([&]() {
+            int sig;
+            while ((0 == sigwait(&cancel_signals, &sig)) && !signals_done) {
+                PRINT("Interrupted, cancelling the build");
+                interrupted = true;
+                runner_state.cancel();
+            }
+        });
 
-    ThreadInfo runners[runners_count];
-    for (auto &th : runners) {
-        th.o_rule = Optional<BuildRule>();
-        th.shutting_down = false;
-        th.thread = new std::thread([&th, &shutdown, &runner_state]() {
-                while (!shutdown) {
-                    TIMEIT(std::unique_lock<std::mutex> lck(th.mutex));
-                    while (!th.o_rule.has_value()) {
-                        th.cv.wait(lck);
-                        if (shutdown) {
-                            th.shutting_down = true;
-                            return;
-                        }
-                    }
-                    lck.unlock();
+    // Without autotune the limit stays at -j
+    ParallelismTuner tuner(max_concurrent_jobs, autotune ? 1 : max_concurrent_jobs,
+                           autotune ? (max_concurrent_jobs * AUTOTUNE_MAX_FACTOR) : max_concurrent_jobs);
+    // Old outputs are deleted in the background, and by the time this
+    // returns
+    Trash trash(TRASH_DIR_PREFIX);
+    Job::set_trash(&trash);
+    DirCache dir_cache;
+    Job::set_dir_cache(&dir_cache);
+    // Outlives the executor, whose workers run the jobs it serves
+    Reactor reactor;
+    Job::set_reactor(&reactor);
+    HookListener hook_listener(reactor);
+    Job::set_hook_listener(&hook_listener);
+    Executor executor(tuner.max());
+    runner_state.executor = &executor;
+    Jobserver jobserver(tuner.max());
+    Job::set_makeflags(jobserver.makeflags());
 
-                    run_job(th.o_rule.get_value(), runner_state);
-                    th.o_rule = Optional<BuildRule>();
-                }
-                th.shutting_down = true;
+    // The first rule must have been admitted already, on behalf of all
+    auto dispatch_batch = [&executor, &runner_state](std::vector<RuleId> rule_ids) {
+        executor.submit([rule_ids, &runner_state]() {
+                run_batch(rule_ids, runner_state);
+                runner_state.admission->release(runner_state.graph.node(rule_ids.front()).demand);
+                runner_state.jobs_in_flight--;
+                runner_state.notify_work();
+                for (uint32_t i = 0; i < rule_ids.size(); i++) runner_state.release_outstanding();
             });
-    }
+    };
 
-    std::thread resolve_th([&build_rules, &shutdown, &runner_state]() {
-            while (!shutdown) {
-                while (true) {
-                    auto req = runner_state.resolve_dequeue();
-                    if (!req.has_value()) break;
+    auto dispatch = [&executor, &runner_state](RuleId rule_id) {
+        executor.submit([rule_id, &runner_state]() {
+                run_job(rule_id, runner_state);
+                runner_state.admission->release(runner_state.graph.node(rule_id).demand);
+                runner_state.jobs_in_flight--;
+                runner_state.notify_work();
+                runner_state.release_outstanding();
+            });
+    };
+
+    std::thread resolve_th([&build_rules, &runner_state]() {
+            while (true) {
+                auto req = runner_state.resolve_dequeue();
+                if (!req.has_value()) break;
+                if (runner_state.cancelled) {
+                    // Nothing is going to run any more, so don't bother the
+                    // query program, which an interrupt may have killed
+                    if (req.get_value().cb) req.get_value().cb(req.get_value().target, NO_RULE);
+                } else {
                     resolve_all(build_rules, runner_state, req.get_value());
                 }
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                runner_state.resolve_done();
             }
         });
 
-    std::vector<std::thread *> sub_job_threads;
-
     while (true)
     {
-        // TODO: bg thread? or use async IO and a reactor?
-        while (true)
+        const uint64_t seen_events = runner_state.get_work_events();
+        const uint32_t limit = tuner.limit();
+        admission.set_cores_budget_milli(limit * 1000);
+
+        // Tokens go first to blocked jobs whose inputs are ready, then to
+        // the jobs someone is blocked on, and only then to new work.
+        // Blocked jobs do not hold tokens, so new work can also be held
+        // back by the separate cap on jobs in flight; the jobs others are
+        // waiting for are not, or blocked jobs could fill it up for good.
+        // Beyond -j, each token also needs one from the jobserver
+        bool jobserver_starved = false;
+        auto take_token = [&]() {
+            if (runner_state.active_jobs >= limit) return false;
+            if (jobserver.acquire_for(runner_state.active_jobs + 1)) return true;
+            jobserver_starved = true;
+            return false;
+        };
+
+        RuleId rule_id;
+        if (runner_state.cancelled) {
+            // Nothing new starts once the build is cancelled
+            uint32_t dropped = 0;
+            while (runner_state.sub_jobs.try_pop(rule_id)) dropped++;
+            {
+                TIMEIT(std::unique_lock<std::mutex> graph_lck (runner_state.graph_mtx));
+                TIMEIT(std::unique_lock<std::mutex> lck (runner_state.job_queue_mtx));
+                for (; runner_state.job_queue.size() > 0; dropped++) runner_state.job_queue.pop();
+            }
+            for (uint32_t i = 0; i < dropped; i++) runner_state.release_outstanding();
+        }
+
+        Resume resume;
+        while (take_token() && runner_state.resumes.try_pop(resume)) {
+            runner_state.active_jobs++;
+            runner_state.grant_resume(resume);
+        }
+
+        while (take_token() && runner_state.sub_jobs.try_pop(rule_id)) {
+            admission.force_admit(runner_state.graph.node(rule_id).demand);
+            runner_state.active_jobs++;
+            runner_state.jobs_in_flight++;
+            dispatch(rule_id);
+        }
+
+        while ((runner_state.jobs_in_flight < max_jobs_in_flight) && take_token())
         {
-            TIMEIT(std::unique_lock<std::mutex> lck (runner_state.mtx));
-            if (runner_state.job_queue.size() == 0) break;
-            if (runner_state.active_jobs.size() >= max_concurrent_jobs) break;
-            auto rule = runner_state.job_queue.front();
-            lck.unlock();
-
-            for (auto &th : runners) {
-                TIMEIT(std::unique_lock<std::mutex> th_lck(th.mutex));
-                if (th.o_rule.has_value()) continue;
-                th.o_rule = Optional<BuildRule>(rule);
-                th.cv.notify_all();
-
-                TIMEIT(lck.lock());
-                runner_state.job_queue.pop_front();
-                lck.unlock();
-                // PRINT("jobs: " << jobs_finished << "/" << jobs_started);
-                break;
+            std::vector<RuleId> batch;
+            {
+                TIMEIT(std::unique_lock<std::mutex> graph_lck (runner_state.graph_mtx));
+                TIMEIT(std::unique_lock<std::mutex> lck (runner_state.job_queue_mtx));
+                if (runner_state.job_queue.size() == 0) break;
+                // Strictly in priority order: a job that does not fit
+                // holds back the ones after it rather than being starved
+                rule_id = runner_state.job_queue.top();
+                if (!admission.try_admit(runner_state.graph.node(rule_id).demand)) break;
+                runner_state.job_queue.pop();
+                // Tiny ready rules right behind it share its shell, token
+                // and admission, since they run one after another
+                if (runner_state.batchable_locked(rule_id)) {
+                    batch.push_back(rule_id);
+                    while ((batch.size() < BATCH_MAX_RULES) && (runner_state.job_queue.size() > 0)) {
+                        const RuleId next_id = runner_state.job_queue.top();
+                        if (!runner_state.batchable_locked(next_id)) break;
+                        runner_state.job_queue.pop();
+                        batch.push_back(next_id);
+                    }
+                }
+            }
+            runner_state.active_jobs++;
+            runner_state.jobs_in_flight++;
+            if (batch.size() > 1) {
+                dispatch_batch(batch);
+            } else {
+                dispatch(rule_id);
             }
         }
+        {
+            TIMEIT(std::unique_lock<std::mutex> lck (runner_state.job_queue_mtx));
+            tuner.tick((runner_state.job_queue.size() > 0) && (runner_state.active_jobs >= limit));
+        }
+        if (runner_state.jobs_in_flight > runner_state.peak_jobs_in_flight) {
+            runner_state.peak_jobs_in_flight = runner_state.jobs_in_flight;
+        }
 
-        while (true) {
-            TIMEIT(std::unique_lock<std::mutex> lck (runner_state.mtx));
-            if (runner_state.sub_jobs.size() == 0) break;
-            auto sub_job = runner_state.sub_jobs.front();
-            runner_state.sub_jobs.pop_front();
-            lck.unlock();
-            sub_job_threads.push_back(new std::thread([sub_job, &runner_state]() {
-                        const bool ready = run_job(sub_job.first, runner_state);
-                        if (!ready) {
-                            TIMEIT(std::unique_lock<std::mutex> lck (runner_state.mtx));
-                            while (runner_state.active_jobs.find(sub_job.first) != runner_state.active_jobs.end()) {
-                                lck.unlock();
-                                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                                lck.lock();
-                            }
-                        }
-                        sub_job.second();
-                    }));
-        }
-
-        while (true) {
-            TIMEIT(std::unique_lock<std::mutex> lck (runner_state.mtx));
-            if (runner_state.done_jobs.size() == 0) break;
-            auto job = runner_state.done_jobs.front();
-            runner_state.done_jobs.pop_front();
+        Job *job;
+        while (runner_state.done_jobs.try_pop(job)) {
             runner_state.jobs_finished++;
+            tuner.jobs_finished(1);
             DEBUG("jobs: " << runner_state.jobs_finished << "/" << runner_state.jobs_started);
             PRINT(runner_state.jobs_finished << "/" << runner_state.jobs_started << "\t" << job->get_rule().outputs.front());
             delete job;
+            runner_state.release_outstanding();
         }
 
-        if (runner_state.jobs_started > 0) {
-            if (!runner_state.has_work()) {
-                PRINT("No more work, stopping");
-                break;
-            }
+        if (!runner_state.has_work()) {
+            PRINT("No more work, stopping");
+            break;
+        }
+
+        // Tokens held for jobs that since finished or blocked go back to
+        // the jobserver, where sub-makes can get them
+        jobserver.trim_to(runner_state.active_jobs);
+
+        if (jobserver_starved) {
+            // Nothing tells us when another process returns a token
+            runner_state.wait_for_work(seen_events, std::chrono::milliseconds(JOBSERVER_POLL_INTERVAL_MS));
+        } else if (admission.backing_off()) {
+            runner_state.wait_for_work(seen_events, AdmissionControl::pressure_poll_interval());
+        } else {
+            runner_state.wait_for_work(seen_events);
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
 
     DEBUG("SHUTDOWN");
-    shutdown = true;
+    runner_state.resolve_stop();
     DEBUG("waiting for resolve thread");
     resolve_th.join();
-    for (auto th : sub_job_threads) {
-        th->join();
-        delete th;
+
+    signals_done = true;
+    pthread_kill(signal_th.native_handle(), SIGTERM);
+    signal_th.join();
+
+    stats.save();
+    const uint64_t build_us = elapsed_us_since(build_start);
+    save_trace(runner_state, tuner.limit(), build_us);
+    PRINT("Early cutoff: " << runner_state.rules_up_to_date << " of " << runner_state.jobs_started << " rules up to date");
+    PRINT("Learned inputs: " << runner_state.learned_prebuilds << " prebuilt, "
+          << runner_state.stalls_avoided << " stalls avoided, "
+          << runner_state.stalls << " stalls");
+    PRINT("Blocked: jobs spent " << (runner_state.blocked_us / 1000) << " ms waiting for inputs without a token, "
+          << "peak " << runner_state.peak_jobs_in_flight << " jobs in flight, "
+          << runner_state.boosted_rules << " rules boosted for them, "
+          << executor.spares_started() << " spare workers started for them");
+    if (runner_state.early_output_wants > 0) {
+        PRINT("Early outputs: " << runner_state.early_output_wants << " wants went on before the rule was done");
     }
-    for (auto &th : runners) {
-        while (!th.shutting_down) {
-            TIMEIT(std::unique_lock<std::mutex> lck(th.mutex));
-            th.cv.notify_all();
-        }
-        DEBUG("waiting for thread");
-        th.thread->join();
-        delete th.thread;
-        th.thread = nullptr;
+    PRINT("Output directories: " << dir_cache.hits() << " of " << dir_cache.lookups() << " lookups answered without a stat");
+    if (runner_state.batches > 0) {
+        PRINT("Batched " << runner_state.batched_rules << " rules into " << runner_state.batches << " shells");
     }
+    admission.print_report();
+    print_schedule_report(runner_state.graph, tuner.limit(), build_us);
+    if (lazy) print_lazy_report(runner_state);
+    print_failures(runner_state);
+    if (interrupted) PRINT("BUILD INTERRUPTED");
+    return !interrupted && (runner_state.failures.size() == 0);
+}
+
+static void usage(const char *prog)
+{
+    PRINT("Usage: " << prog << " [-k] [-l] [-j <jobs>|auto] [-p <max jobs in flight>] [-m <memory budget MiB>] [-b <batch threshold ms>] <query program> <target>...");
 }
 
 int main(int argc, char **argv)
 {
     ASSERT(argc >= 0);
-    if (argc < 3) {
-        PRINT("Usage: " << argv[0] << " <query program> <target>");
-        return 1;
+
+    uint32_t jobs = default_jobs_count();
+    bool autotune = false;
+    uint32_t max_jobs_in_flight = 0;
+    uint64_t memory_budget_kb = available_memory_kb();
+    uint64_t batch_threshold_us = 0;
+    bool keep_going = false;
+    bool lazy = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "klj:p:m:b:")) != -1) {
+        switch (opt) {
+        case 'k':
+            keep_going = true;
+            break;
+        case 'l':
+            lazy = true;
+            break;
+        case 'j': {
+            if (0 == strcmp(optarg, "auto")) {
+                // Start from the default and adapt from there
+                autotune = true;
+                break;
+            }
+            char *endptr;
+            const long val = strtol(optarg, &endptr, 10);
+            if ((*endptr != '\0') || (val <= 0)) {
+                PRINT("Invalid job count: " << optarg);
+                return 1;
+            }
+            jobs = (uint32_t)val;
+            break;
+        }
+        case 'p': {
+            char *endptr;
+            const long val = strtol(optarg, &endptr, 10);
+            if ((*endptr != '\0') || (val <= 0)) {
+                PRINT("Invalid job count: " << optarg);
+                return 1;
+            }
+            max_jobs_in_flight = (uint32_t)val;
+            break;
+        }
+        case 'm': {
+            char *endptr;
+            const long long val = strtoll(optarg, &endptr, 10);
+            if ((*endptr != '\0') || (val <= 0)) {
+                PRINT("Invalid memory budget: " << optarg);
+                return 1;
+            }
+            memory_budget_kb = (uint64_t)val * 1024;
+            break;
+        }
+        case 'b': {
+            char *endptr;
+            const double val = strtod(optarg, &endptr);
+            if ((*endptr != '\0') || (val < 0)) {
+                PRINT("Invalid batch threshold: " << optarg);
+                return 1;
+            }
+            batch_threshold_us = (uint64_t)(val * 1000);
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
     }
 
-    DEBUG("Main: " << argc);
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    BuildRules build_rules(argv[1]);
+    // Blocked jobs are cheap to keep around, but each is a live process tree
+    if (max_jobs_in_flight == 0) max_jobs_in_flight = jobs * (autotune ? AUTOTUNE_MAX_FACTOR : 1) * 4;
+    if (max_jobs_in_flight < jobs) max_jobs_in_flight = jobs;
+    DEBUG("Main: " << argc << " jobs: " << jobs);
 
     std::vector<std::string> targets;
-    for (uint32_t i = 2; i < (uint32_t)argc; i++) {
+    for (uint32_t i = optind + 1; i < (uint32_t)argc; i++) {
         targets.emplace_back(argv[i]);
     }
 
-    build(build_rules, targets);
+    // Run by one of our own jobs: the master builds the targets, within
+    // its own job limit
+    if (running_under_master()) return build_in_master(targets);
+
+    BuildRules build_rules(argv[optind]);
+
+    const bool built = build(build_rules, targets, jobs, autotune, max_jobs_in_flight, memory_budget_kb,
+                             batch_threshold_us, keep_going, lazy);
 
-    return 0;
+    return built ? 0 : 1;
 }
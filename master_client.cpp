@@ -0,0 +1,138 @@
+#include "master_client.h"
+#include "assert.h"
+
+#include <sstream>
+
+extern "C" {
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+#define PROTOCOL_HELLO "PROTOCOL10: HELLO, I AM: "
+#define MAX_MESSAGE_SIZE 0x7000
+
+bool running_under_master()
+{
+    return (getenv("BUILDSOME_MASTER_UNIX_SOCKADDR") != nullptr) && (getenv("BUILDSOME_JOB_ID") != nullptr);
+}
+
+static bool send_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        const ssize_t sent = send(fd, buf, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        buf += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Same framing as the hook's messages: a big-endian size, then the data
+static bool send_message(int fd, const std::string &message)
+{
+    const uint32_t size_n = htonl(message.size());
+    return send_all(fd, (const char *)&size_n, sizeof(size_n)) && send_all(fd, message.c_str(), message.size());
+}
+
+static bool recv_go(int fd)
+{
+    char buf[2];
+    return (sizeof(buf) == recv(fd, buf, sizeof(buf), MSG_WAITALL)) && (0 == memcmp(buf, "GO", sizeof(buf)));
+}
+
+// Resolves "." and ".." without touching the file system, since the
+// target need not exist yet
+static std::string canonize_path(const std::string &abs_path)
+{
+    std::vector<std::string> parts;
+    std::istringstream stream(abs_path);
+    std::string part;
+    while (std::getline(stream, part, '/')) {
+        if ((part.size() == 0) || (part == ".")) continue;
+        if (part == "..") {
+            if (parts.size() > 0) parts.pop_back();
+            continue;
+        }
+        parts.push_back(part);
+    }
+    std::string result;
+    for (auto &p : parts) result += "/" + p;
+    return (result.size() > 0) ? result : "/";
+}
+
+// Targets are named relative to the master's directory, as the hook does
+static std::string master_path(const std::string &cwd, const std::string &root, const std::string &target)
+{
+    const std::string path = canonize_path((target[0] == '/') ? target : (cwd + "/" + target));
+    if (path == root) return ".";
+    if ((root.size() > 0) && (path.compare(0, root.size(), root) == 0) && (path[root.size()] == '/')) {
+        return path.substr(root.size() + 1);
+    }
+    return path;
+}
+
+int build_in_master(const std::vector<std::string> &targets)
+{
+    const char *sock_addr = getenv("BUILDSOME_MASTER_UNIX_SOCKADDR");
+    const char *job_id = getenv("BUILDSOME_JOB_ID");
+    const char *root_filter = getenv("BUILDSOME_ROOT_FILTER");
+    ASSERT(sock_addr && job_id);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT(fd >= 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    ASSERT(strlen(sock_addr) < sizeof(addr.sun_path));
+    strcpy(addr.sun_path, sock_addr);
+    socklen_t addr_len = sizeof(addr);
+    if (sock_addr[0] == '@') {
+        // Abstract: the @ stands for a NUL, and no NUL ends it
+        addr.sun_path[0] = '\0';
+        addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(sock_addr);
+    }
+    if (0 != connect(fd, (struct sockaddr *)&addr, addr_len)) {
+        PRINT("Cannot connect to the build master at " << sock_addr);
+        close(fd);
+        return 1;
+    }
+
+    std::ostringstream hello;
+    hello << PROTOCOL_HELLO << getpid() << ":" << getpid() << ":" << job_id << ":BUILD";
+    char *const cwd = get_current_dir_name();
+    const std::string cwd_str(cwd);
+    free(cwd);
+    const std::string root = (root_filter != nullptr) ? canonize_path(root_filter) : std::string();
+
+    // One target per message and an empty one to end the request, then
+    // a GO once all of them are built
+    bool ok = send_message(fd, hello.str()) && recv_go(fd);
+    for (auto &target : targets) {
+        if (!ok) break;
+        const std::string path = master_path(cwd_str, root, target);
+        ASSERT(path.size() < MAX_MESSAGE_SIZE);
+        ok = send_message(fd, path);
+    }
+    ok = ok && send_message(fd, std::string()) && recv_go(fd);
+    close(fd);
+    if (!ok) {
+        PRINT("Lost the connection to the build master");
+        return 1;
+    }
+
+    // The master fails the job if anything it asked for failed, so only
+    // targets that nothing builds can be missing here
+    int status = 0;
+    for (auto &target : targets) {
+        if (0 != access(target.c_str(), F_OK)) {
+            PRINT("Failed to resolve: " << target);
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/* Commands run by the build get BUILDSOME_MASTER_UNIX_SOCKADDR and
+ * BUILDSOME_JOB_ID from the master. When one of them runs us again, we
+ * do not start a build of our own: the targets are handed to the master
+ * on behalf of the job, and built there with its rules, its finished
+ * rules and its job limit, as if the job had asked for each of them
+ * through the hook. */
+bool running_under_master();
+
+// Returns the exit status for the nested invocation
+int build_in_master(const std::vector<std::string> &targets);
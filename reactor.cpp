@@ -0,0 +1,218 @@
+#include "reactor.h"
+#include "assert.h"
+
+extern "C" {
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+}
+
+#define WAKE_ID 0
+#define SIGNAL_ID 1
+#define MAX_EVENTS 64
+
+static int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+Reactor::Reactor()
+    : m_next_id(SIGNAL_ID + 1)
+{
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    ASSERT(m_epoll_fd >= 0);
+    m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ASSERT(m_wake_fd >= 0);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_ID;
+    ASSERT(0 == epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event));
+
+    const int pidfd = pidfd_open(getpid());
+    if (pidfd >= 0) {
+        close(pidfd);
+    } else {
+        sigset_t child_signal;
+        sigemptyset(&child_signal);
+        sigaddset(&child_signal, SIGCHLD);
+        m_signal_fd = signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC);
+        ASSERT(m_signal_fd >= 0);
+        event.data.u64 = SIGNAL_ID;
+        ASSERT(0 == epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_signal_fd, &event));
+    }
+    m_thread = new std::thread(&Reactor::loop_main, this);
+}
+
+Reactor::~Reactor()
+{
+    post([this]() { m_stopping = true; });
+    m_thread->join();
+    delete m_thread;
+    ASSERT(m_handlers.size() == 0);
+    if (m_signal_fd >= 0) close(m_signal_fd);
+    close(m_wake_fd);
+    close(m_epoll_fd);
+}
+
+Reactor::HandlerId Reactor::add_fd(int fd, std::function<void(void)> cb)
+{
+    HandlerId id;
+    {
+        std::unique_lock<std::mutex> lck (m_mtx);
+        id = m_next_id++;
+    }
+    add_fd_with_id(id, fd, cb);
+    return id;
+}
+
+void Reactor::add_fd_with_id(HandlerId id, int fd, std::function<void(void)> cb)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    m_handlers[id] = std::make_pair(fd, cb);
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = id;
+    ASSERT(0 == epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event));
+}
+
+void Reactor::remove(HandlerId id)
+{
+    if (in_loop()) {
+        remove_now(id);
+        return;
+    }
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool removed = false;
+    post([&]() {
+            remove_now(id);
+            std::unique_lock<std::mutex> lck (mtx);
+            removed = true;
+            cv.notify_all();
+        });
+    std::unique_lock<std::mutex> lck (mtx);
+    while (!removed) cv.wait(lck);
+}
+
+void Reactor::remove_now(HandlerId id)
+{
+    std::unique_lock<std::mutex> lck (m_mtx);
+    auto found = m_handlers.find(id);
+    ASSERT(found != m_handlers.end());
+    ASSERT(0 == epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, found->second.first, NULL));
+    m_handlers.erase(found);
+}
+
+void Reactor::watch_child(pid_t pid, ExitCb on_exit)
+{
+    if (m_signal_fd >= 0) {
+        // It may have exited before it was known here, so look right away
+        post([this, pid, on_exit]() {
+                m_children[pid] = on_exit;
+                reap_children();
+            });
+        return;
+    }
+    // Nobody else waits for it, so the pid stays valid until reaped
+    const int pidfd = pidfd_open(pid);
+    ASSERT(pidfd >= 0);
+    HandlerId id;
+    {
+        std::unique_lock<std::mutex> lck (m_mtx);
+        id = m_next_id++;
+    }
+    add_fd_with_id(id, pidfd, [this, id, pidfd, pid, on_exit]() {
+            remove_now(id);
+            close(pidfd);
+            int wait_status;
+            struct rusage usage;
+            pid_t res;
+            do {
+                res = wait4(pid, &wait_status, 0, &usage);
+            } while ((res < 0) && (errno == EINTR));
+            ASSERT(res == pid);
+            on_exit(wait_status, usage);
+        });
+}
+
+void Reactor::reap_children()
+{
+    for (auto it = m_children.begin(); it != m_children.end(); ) {
+        int wait_status;
+        struct rusage usage;
+        const pid_t res = wait4(it->first, &wait_status, WNOHANG, &usage);
+        ASSERT((res >= 0) || (errno == EINTR));
+        if (res != it->first) {
+            ++it;
+            continue;
+        }
+        const ExitCb on_exit = it->second;
+        it = m_children.erase(it);
+        on_exit(wait_status, usage);
+    }
+}
+
+void Reactor::post(std::function<void(void)> fn)
+{
+    {
+        std::unique_lock<std::mutex> lck (m_mtx);
+        m_posted.push_back(fn);
+    }
+    const uint64_t one = 1;
+    ASSERT(sizeof(one) == write(m_wake_fd, &one, sizeof(one)));
+}
+
+void Reactor::run_posted()
+{
+    uint64_t count;
+    while (sizeof(count) == read(m_wake_fd, &count, sizeof(count))) { }
+    std::vector<std::function<void(void)> > posted;
+    {
+        std::unique_lock<std::mutex> lck (m_mtx);
+        posted.swap(m_posted);
+    }
+    for (auto &fn : posted) fn();
+}
+
+void Reactor::loop_main()
+{
+    struct epoll_event events[MAX_EVENTS];
+    while (!m_stopping) {
+        const int count = epoll_wait(m_epoll_fd, events, MAX_EVENTS, -1);
+        if ((count < 0) && (errno == EINTR)) continue;
+        ASSERT(count >= 0);
+        for (int i = 0; i < count; i++) {
+            const HandlerId id = events[i].data.u64;
+            if (id == WAKE_ID) {
+                run_posted();
+                continue;
+            }
+            if (id == SIGNAL_ID) {
+                struct signalfd_siginfo info;
+                while (sizeof(info) == read(m_signal_fd, &info, sizeof(info))) { }
+                reap_children();
+                continue;
+            }
+            // An earlier callback of this round may have removed it
+            std::function<void(void)> cb;
+            {
+                std::unique_lock<std::mutex> lck (m_mtx);
+                auto found = m_handlers.find(id);
+                if (found == m_handlers.end()) continue;
+                cb = found->second.second;
+            }
+            cb();
+        }
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/resource.h>
+}
+
+/* A single thread waiting on many fds with epoll, which calls back
+ * whoever registered each fd, on that thread. Child exits come in
+ * through a pidfd per child or, on kernels without pidfd_open, through
+ * a signalfd for SIGCHLD, which only works with SIGCHLD blocked in
+ * every thread.
+ *
+ * Callbacks run one at a time and must not block; other threads hand
+ * work to the loop with post(). */
+class Reactor {
+public:
+    typedef uint64_t HandlerId;
+    // The status and resource usage wait4 reported for the child
+    typedef std::function<void(int wait_status, const struct rusage &usage)> ExitCb;
+
+    Reactor();
+    ~Reactor();
+
+    // Calls cb whenever fd is readable or hung up, until removed
+    HandlerId add_fd(int fd, std::function<void(void)> cb);
+    // Once this returns, the callback is not running and will not run
+    // again. Closing the fd is up to the caller.
+    void remove(HandlerId id);
+    // Reaps the child once it exits, then calls on_exit
+    void watch_child(pid_t pid, ExitCb on_exit);
+    void post(std::function<void(void)> fn);
+    bool in_loop() const { return std::this_thread::get_id() == m_thread->get_id(); }
+
+    Reactor(const Reactor &) =delete;
+    Reactor& operator=(const Reactor &) =delete;
+
+private:
+    void loop_main();
+    void add_fd_with_id(HandlerId id, int fd, std::function<void(void)> cb);
+    void remove_now(HandlerId id);
+    void run_posted();
+    void reap_children();
+
+    int m_epoll_fd;
+    int m_wake_fd; // an eventfd, written by post()
+    int m_signal_fd = -1; // only without pidfds
+    bool m_stopping = false;
+
+    mutable std::mutex m_mtx;
+    HandlerId m_next_id;
+    std::map<HandlerId, std::pair<int, std::function<void(void)> > > m_handlers;
+    std::vector<std::function<void(void)> > m_posted;
+
+    // Children waited for through the signalfd; only the loop touches it
+    std::map<pid_t, ExitCb> m_children;
+    std::thread *m_thread;
+};
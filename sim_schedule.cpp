@@ -0,0 +1,250 @@
+#include "build_trace.h"
+#include "build_graph.h"
+#include "assert.h"
+
+#include <iostream>
+#include <iomanip>
+#include <deque>
+#include <queue>
+#include <tuple>
+
+extern "C" {
+#include <stdlib.h>
+#include <unistd.h>
+}
+
+#define BUILD_TRACE_PATH ".trigger.trace"
+
+/* Replays a build recorded in .trigger.trace on a virtual clock, under
+ * several scheduling policies, and reports how long each would have
+ * taken. Rules are queued in the order they were resolved and prioritized
+ * by the same BuildGraph bottom levels and JobQueue the build uses. As in
+ * the build, a rule may start before its inputs are built: when its
+ * commands want one that is not, it stalls there and gives up its token
+ * until the input is done. */
+struct Policy {
+    const char *name;
+    bool critical_path; // queue by bottom level, rather than resolve order
+    bool boost; // move what a blocked job waits for ahead, with its inputs
+    bool inputs_first; // start a rule only once its inputs are built, as make does
+};
+
+static const Policy POLICIES[] = {
+    { "fifo", false, false, false },
+    { "fifo+boost", false, true, false },
+    { "critical-path", true, false, false },
+    { "critical-path+boost", true, true, false }, // what the build does
+    { "inputs-first", true, false, true },
+};
+
+struct SimResult {
+    uint64_t makespan_us = 0;
+    uint64_t busy_us = 0; // token time spent running commands
+    uint64_t cpu_us = 0;
+    uint64_t stalls = 0;
+    uint32_t stuck_rules = 0; // never finished, waiting in a cycle
+};
+
+enum class SimState {
+    Idle,
+    Running, // holds a token, or waits for one to resume
+    Blocked,
+    Done,
+};
+
+struct SimRule {
+    SimState state = SimState::Idle;
+    uint64_t progress_us = 0; // at its pending event, while running
+    uint32_t next_want = 0;
+    uint32_t missing_inputs = 0;
+    bool sub_job = false; // queued because someone is blocked on it
+    std::vector<RuleId> waiters;
+};
+
+static SimResult simulate(const BuildTrace &trace, const BuildGraph &graph, const Policy &policy, uint32_t jobs)
+{
+    const uint32_t count = trace.rules.size();
+    std::vector<SimRule> rules(count);
+    JobQueue queue;
+    std::deque<RuleId> resumes, sub_jobs;
+    // (time, sequence, rule): a running rule's next want or its end
+    typedef std::tuple<uint64_t, uint64_t, RuleId> Event;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event> > events;
+    uint64_t now = 0, seq = 0;
+    uint32_t tokens = jobs, finished = 0;
+    SimResult result;
+
+    auto priority = [&](RuleId id) {
+        return policy.critical_path ? graph.node(id).bottom_level_us : 0;
+    };
+    for (RuleId id = 0; id < count; id++) {
+        rules[id].missing_inputs = graph.node(id).inputs.size();
+        if (!policy.inputs_first || (rules[id].missing_inputs == 0)) queue.push(id, priority(id));
+    }
+
+    // Runs the rule up to its next want, or to its end
+    auto run_segment = [&](RuleId id) {
+        SimRule &rule = rules[id];
+        const TraceRule &traced = trace.rules[id];
+        uint64_t until_us = traced.duration_us;
+        if (rule.next_want < traced.wants.size()) {
+            until_us = std::max(rule.progress_us, std::min(until_us, traced.wants[rule.next_want].first));
+        }
+        rule.state = SimState::Running;
+        result.busy_us += until_us - rule.progress_us;
+        events.push(Event(now + until_us - rule.progress_us, seq++, id));
+        rule.progress_us = until_us;
+    };
+    auto boost = [&](RuleId rule_id) {
+        std::vector<RuleId> stack;
+        stack.push_back(rule_id);
+        while (stack.size() > 0) {
+            const RuleId id = stack.back();
+            stack.pop_back();
+            if (!queue.boost(id)) continue;
+            for (auto input : graph.node(id).inputs) stack.push_back(input);
+        }
+    };
+
+    while (finished < count) {
+        // The build loop's order: resumes, then what blocked jobs wait
+        // for, then the queue
+        while (tokens > 0) {
+            RuleId id;
+            if (resumes.size() > 0) {
+                id = resumes.front();
+                resumes.pop_front();
+            } else if (sub_jobs.size() > 0) {
+                id = sub_jobs.front();
+                sub_jobs.pop_front();
+                if (rules[id].state != SimState::Idle) continue;
+            } else if (queue.size() > 0) {
+                id = queue.pop();
+                if (rules[id].state != SimState::Idle) continue;
+            } else {
+                break;
+            }
+            tokens--;
+            run_segment(id);
+        }
+        if (events.size() == 0) {
+            result.stuck_rules = count - finished;
+            break;
+        }
+
+        const Event event = events.top();
+        events.pop();
+        now = std::get<0>(event);
+        const RuleId id = std::get<2>(event);
+        SimRule &rule = rules[id];
+        const TraceRule &traced = trace.rules[id];
+
+        if (rule.next_want < traced.wants.size()) {
+            const RuleId want = traced.wants[rule.next_want++].second;
+            if ((want == id) || (rules[want].state == SimState::Done)) {
+                run_segment(id);
+                continue;
+            }
+            result.stalls++;
+            tokens++;
+            rule.state = SimState::Blocked;
+            rules[want].waiters.push_back(id);
+            if ((rules[want].state == SimState::Idle) && !rules[want].sub_job) {
+                rules[want].sub_job = true;
+                sub_jobs.push_back(want);
+            }
+            if (policy.boost) boost(want);
+            continue;
+        }
+
+        rule.state = SimState::Done;
+        tokens++;
+        finished++;
+        // Unmeasured rules count as keeping one core busy
+        result.cpu_us += (traced.cpu_us > 0) ? traced.cpu_us : traced.duration_us;
+        for (auto waiter : rule.waiters) {
+            rules[waiter].state = SimState::Running;
+            resumes.push_back(waiter);
+        }
+        rule.waiters.clear();
+        for (auto consumer : graph.node(id).consumers) {
+            if ((--rules[consumer].missing_inputs == 0) && policy.inputs_first) {
+                queue.push(consumer, priority(consumer));
+            }
+        }
+    }
+    result.makespan_us = now;
+    return result;
+}
+
+static void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [-j <jobs>]... [<trace>]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<uint32_t> jobs_counts;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+        case 'j': {
+            char *endptr;
+            const long val = strtol(optarg, &endptr, 10);
+            if ((*endptr != '\0') || (val <= 0)) {
+                std::cerr << "Invalid job count: " << optarg << std::endl;
+                return 1;
+            }
+            jobs_counts.push_back((uint32_t)val);
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const std::string path = (argc - optind == 1) ? argv[optind] : BUILD_TRACE_PATH;
+
+    BuildTrace trace;
+    if (!trace.load(path)) {
+        std::cerr << "Cannot read build trace: " << path << std::endl;
+        return 1;
+    }
+    if (jobs_counts.size() == 0) jobs_counts.push_back(std::max(trace.jobs, 1U));
+
+    // Bottom levels come from the same graph code the build uses
+    BuildGraph graph;
+    for (auto &rule : trace.rules) {
+        BuildRule build_rule;
+        build_rule.outputs.push_back(rule.name);
+        graph.add_rule(build_rule, std::vector<TargetId>(), rule.duration_us);
+    }
+    for (RuleId id = 0; id < trace.rules.size(); id++) {
+        for (auto input : trace.rules[id].inputs) graph.add_edge(input, id);
+    }
+
+    std::cout << trace.rules.size() << " rules, recorded with -j " << trace.jobs
+              << " in " << (trace.makespan_us / 1000) << " ms" << std::endl;
+    for (auto jobs : jobs_counts) {
+        std::cout << std::endl << "-j " << jobs << std::endl;
+        std::cout << std::left << std::setw(22) << "policy" << std::right
+                  << std::setw(13) << "makespan ms" << std::setw(13) << "tokens busy"
+                  << std::setw(10) << "cpu busy" << std::setw(8) << "stalls" << std::endl;
+        for (auto &policy : POLICIES) {
+            const SimResult result = simulate(trace, graph, policy, jobs);
+            const double capacity_us = std::max(result.makespan_us, (uint64_t)1) * (double)jobs;
+            std::cout << std::left << std::setw(22) << policy.name << std::right
+                      << std::setw(13) << (result.makespan_us / 1000)
+                      << std::setw(12) << (uint32_t)(100 * result.busy_us / capacity_us) << "%"
+                      << std::setw(9) << (uint32_t)(100 * result.cpu_us / capacity_us) << "%"
+                      << std::setw(8) << result.stalls;
+            if (result.stuck_rules > 0) std::cout << "  (" << result.stuck_rules << " rules stuck in cycles)";
+            std::cout << std::endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include "spawner.h"
+#include "assert.h"
+
+extern "C" {
+#include <spawn.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+}
+
+pid_t spawn_process(const char *path, const char *const argv[], const char *const envp[],
+                    const std::vector<std::pair<int, int> > &dup_fds)
+{
+    posix_spawn_file_actions_t actions;
+    ASSERT(0 == posix_spawn_file_actions_init(&actions));
+    for (auto &fds : dup_fds) {
+        ASSERT(0 == posix_spawn_file_actions_adddup2(&actions, fds.first, fds.second));
+    }
+
+    posix_spawnattr_t attr;
+    ASSERT(0 == posix_spawnattr_init(&attr));
+    // The master blocks the signals it waits for; commands must see them
+    sigset_t none;
+    sigemptyset(&none);
+    ASSERT(0 == posix_spawnattr_setsigmask(&attr, &none));
+    ASSERT(0 == posix_spawnattr_setpgroup(&attr, 0));
+    ASSERT(0 == posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK));
+
+    pid_t pid;
+    const int res = posix_spawn(&pid, path, &actions, &attr, (char *const*)argv, (char *const*)envp);
+    if (0 != res) PANIC("posix_spawn " << path << " failed: " << strerror(res));
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+/* Starts commands with posix_spawn, which glibc does with a vfork-style
+ * clone: the child shares the master's memory until it execs, so starting
+ * one costs the same however big the master's heap or however many
+ * threads it runs, unlike fork, which copies every mapping.
+ *
+ * The child gets a process group of its own, so it can be killed along
+ * with everything it starts, and no blocked signals. dup_fds are (from,
+ * to) pairs dup2'd in the child; other fds are inherited unless they are
+ * close-on-exec, as with fork and exec. */
+pid_t spawn_process(const char *path, const char *const argv[], const char *const envp[],
+                    const std::vector<std::pair<int, int> > &dup_fds = std::vector<std::pair<int, int> >());
@@ -0,0 +1,90 @@
+#include "symbol_table.h"
+#include "assert.h"
+
+extern "C" {
+#include <string.h>
+}
+
+#define ARENA_CHUNK_SIZE (1 << 18)
+#define INITIAL_SLOTS (1 << 8)
+
+static uint32_t hash_str(const char *str, uint32_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+SymbolTable::SymbolTable()
+{
+    for (auto &shard : m_shards) {
+        shard.slots.resize(INITIAL_SLOTS, 0);
+    }
+}
+
+SymbolTable::~SymbolTable()
+{
+    for (auto &shard : m_shards) {
+        for (auto chunk : shard.arena_chunks) delete[] chunk;
+    }
+}
+
+// Called with the shard's mtx held
+const char *SymbolTable::Shard::arena_copy(const char *str, uint32_t len)
+{
+    if (len + 1 > this->arena_left) {
+        // Paths longer than a chunk get a chunk of their own
+        const uint32_t chunk_size = (len + 1 > ARENA_CHUNK_SIZE) ? (len + 1) : ARENA_CHUNK_SIZE;
+        this->arena_pos = new char[chunk_size];
+        this->arena_left = chunk_size;
+        this->arena_chunks.push_back(this->arena_pos);
+    }
+    char *const result = this->arena_pos;
+    memcpy(result, str, len);
+    result[len] = '\0';
+    this->arena_pos += len + 1;
+    this->arena_left -= len + 1;
+    return result;
+}
+
+// Called with the shard's mtx held
+void SymbolTable::Shard::grow_slots(const DenseArray<Name> &names)
+{
+    std::vector<uint32_t> new_slots(this->slots.size() * 2, 0);
+    const uint32_t mask = new_slots.size() - 1;
+    for (auto slot : this->slots) {
+        if (slot == 0) continue;
+        uint32_t pos = names[slot - 1].hash & mask;
+        while (new_slots[pos] != 0) pos = (pos + 1) & mask;
+        new_slots[pos] = slot;
+    }
+    this->slots.swap(new_slots);
+}
+
+TargetId SymbolTable::intern(const char *str, uint32_t len)
+{
+    const uint32_t hash = hash_str(str, len);
+    // The low bits pick the slot within a shard, so shard by the high ones
+    Shard &shard = m_shards[(hash >> 26) % SHARDS_COUNT];
+    TIMEIT(std::unique_lock<std::mutex> lck (shard.mtx));
+    const uint32_t mask = shard.slots.size() - 1;
+    uint32_t pos = hash & mask;
+    while (shard.slots[pos] != 0) {
+        const Name &name = m_names[shard.slots[pos] - 1];
+        if ((name.hash == hash) && (name.len == len) && (0 == memcmp(name.str, str, len))) {
+            return shard.slots[pos] - 1;
+        }
+        pos = (pos + 1) & mask;
+    }
+    const Name name = { shard.arena_copy(str, len), len, hash };
+    const TargetId id = m_names.push_back(name);
+    shard.slots[pos] = id + 1;
+    shard.count++;
+    // Keep the load factor at or below one half
+    if (shard.count * 2 > shard.slots.size()) shard.grow_slots(m_names);
+    return id;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "dense_array.h"
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <mutex>
+
+typedef uint32_t TargetId;
+
+/* Interns target paths: each distinct path is copied once into an arena
+ * and gets a dense TargetId. Lookups of known paths go through an
+ * open-addressing table of IDs, so the per-target overhead is the string
+ * itself plus a few words. The table is split into shards by hash, each
+ * with its own lock and arena, so concurrent interning rarely contends.
+ * name() does not lock. */
+class SymbolTable {
+public:
+    SymbolTable();
+    ~SymbolTable();
+
+    TargetId intern(const std::string &str) { return intern(str.c_str(), str.size()); }
+    TargetId intern(const char *str, uint32_t len);
+
+    const char *name(TargetId id) const { return m_names[id].str; }
+    uint32_t size() const { return m_names.size(); }
+
+    SymbolTable(const SymbolTable &) =delete;
+    SymbolTable& operator=(const SymbolTable &) =delete;
+
+private:
+    struct Name {
+        const char *str;
+        uint32_t len;
+        uint32_t hash;
+    };
+
+    struct Shard {
+        std::vector<uint32_t> slots; // TargetId + 1, or 0 when empty
+        uint32_t count = 0;
+        std::vector<char *> arena_chunks;
+        char *arena_pos = nullptr;
+        uint32_t arena_left = 0;
+        std::mutex mtx;
+
+        const char *arena_copy(const char *str, uint32_t len);
+        void grow_slots(const DenseArray<Name> &names);
+    };
+
+    static constexpr const uint32_t SHARDS_COUNT = 64;
+
+    DenseArray<Name> m_names;
+    Shard m_shards[SHARDS_COUNT];
+};
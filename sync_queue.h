@@ -0,0 +1,34 @@
+#pragma once
+
+#include "assert.h"
+
+#include <deque>
+#include <mutex>
+
+/* A multi-producer multi-consumer FIFO with its own lock, so producers
+ * and consumers of one queue never contend with users of another. */
+template <typename T> class SyncQueue
+{
+private:
+    std::deque<T> m_items;
+    mutable std::mutex m_mtx;
+
+public:
+    void push(const T &item) {
+        TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+        m_items.push_back(item);
+    }
+
+    bool try_pop(T &out_item) {
+        TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+        if (m_items.size() == 0) return false;
+        out_item = m_items.front();
+        m_items.pop_front();
+        return true;
+    }
+
+    std::size_t size() const {
+        TIMEIT(std::unique_lock<std::mutex> lck (m_mtx));
+        return m_items.size();
+    }
+};
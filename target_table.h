@@ -0,0 +1,66 @@
+#pragma once
+
+#include "assert.h"
+#include "symbol_table.h"
+#include "build_graph.h"
+
+#include <cinttypes>
+#include <atomic>
+
+// Entry of a target that was not queried yet
+#define UNRESOLVED_TARGET ((RuleId)-2)
+
+/* What each interned target resolved to: the RuleId building it, NO_RULE,
+ * or UNRESOLVED_TARGET. Indexed directly by TargetId, with one atomic
+ * word per target and no locks. */
+class TargetTable {
+private:
+    static constexpr const uint32_t CHUNK_BITS = 12;
+    static constexpr const uint32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+    static constexpr const uint32_t MAX_CHUNKS = 1 << 16;
+
+    // Entries are stored biased by UNRESOLVED_TARGET, so that a freshly
+    // zeroed chunk reads as all-unresolved
+    std::atomic<std::atomic<uint32_t> *> m_chunks[MAX_CHUNKS];
+
+    std::atomic<uint32_t> &entry(TargetId target) {
+        const uint32_t chunk_idx = target >> CHUNK_BITS;
+        ASSERT(chunk_idx < MAX_CHUNKS);
+        std::atomic<uint32_t> *chunk = m_chunks[chunk_idx];
+        if (chunk == nullptr) {
+            std::atomic<uint32_t> *fresh = new std::atomic<uint32_t>[CHUNK_SIZE]();
+            if (m_chunks[chunk_idx].compare_exchange_strong(chunk, fresh)) {
+                chunk = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        return chunk[target & (CHUNK_SIZE - 1)];
+    }
+
+public:
+    TargetTable() {
+        for (auto &chunk : m_chunks) chunk = nullptr;
+    }
+
+    ~TargetTable() {
+        for (auto &chunk : m_chunks) delete[] chunk.load();
+    }
+
+    TargetTable(const TargetTable &) =delete;
+    TargetTable& operator=(const TargetTable &) =delete;
+
+    RuleId get(TargetId target) {
+        return this->entry(target).load() + UNRESOLVED_TARGET;
+    }
+
+    void set(TargetId target, RuleId rule_id) {
+        this->entry(target).store(rule_id - UNRESOLVED_TARGET);
+    }
+
+    // Sets the entry only if the target was not resolved yet
+    void set_if_unresolved(TargetId target, RuleId rule_id) {
+        uint32_t expected = 0;
+        this->entry(target).compare_exchange_strong(expected, rule_id - UNRESOLVED_TARGET);
+    }
+};
@@ -0,0 +1,63 @@
+#include "file_hash.h"
+#include "assert.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+
+extern "C" {
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+static void write_file(const std::string &path, const std::string &content)
+{
+    std::ofstream file(path, std::ios::trunc);
+    file << content;
+}
+
+// Hashes files and directories in a scratch directory, changing them in
+// between, and checks that the hashes change exactly when they should
+int main()
+{
+    char dir_template[] = "/tmp/test_file_hash.XXXXXX";
+    ASSERT(nullptr != mkdtemp(dir_template));
+    const std::string dir = dir_template;
+    const std::string file = dir + "/file";
+
+    ASSERT(file_hash(file) == "-");
+
+    write_file(file, "content\n");
+    const std::string file_before = file_hash(file);
+    ASSERT(file_before == file_hash(file));
+    ASSERT(file_before == data_hash("content\n"));
+    write_file(file, "other content\n");
+    ASSERT(file_before != file_hash(file));
+    write_file(file, "content\n");
+    ASSERT(file_before == file_hash(file));
+
+    // Only the names and types of the entries count, not their content
+    const std::string dir_before = file_hash(dir);
+    ASSERT(dir_before == file_hash(dir));
+    ASSERT(dir_before != file_before);
+    write_file(file, "other content\n");
+    ASSERT(dir_before == file_hash(dir));
+
+    write_file(dir + "/added", "");
+    const std::string dir_added = file_hash(dir);
+    ASSERT(dir_before != dir_added);
+    ASSERT(0 == unlink((dir + "/added").c_str()));
+    ASSERT(dir_before == file_hash(dir));
+
+    // The same name as a directory instead of a file
+    ASSERT(0 == mkdir((dir + "/added").c_str(), 0700));
+    ASSERT(dir_before != file_hash(dir));
+    ASSERT(dir_added != file_hash(dir));
+    ASSERT(0 == rmdir((dir + "/added").c_str()));
+
+    ASSERT(0 == unlink(file.c_str()));
+    ASSERT(0 == rmdir(dir.c_str()));
+    std::cout << "OK" << std::endl;
+    return 0;
+}
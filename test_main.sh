@@ -0,0 +1,114 @@
+#!/bin/bash
+# End-to-end checks of out/main, run after make. Each check builds rules
+# answered by test_query.sh in a fresh directory of its own, and fails
+# if the build does not end as expected.
+set -u
+SRC=$(cd "$(dirname "$0")" && pwd)
+MAIN="$SRC/out/main"
+QUERY="$SRC/test_query.sh"
+
+# The rules go one per argument, in test_query.sh's format
+rules() {
+    printf '%s\n' "$@" > rules
+}
+
+build() {
+    timeout -k 5 30 "$MAIN" "$QUERY" "$@" > log.txt 2>&1
+}
+
+# A job that reads many sources never blocks, so no spare executor
+# worker is started for it
+test_many_inputs() {
+    mkdir src
+    for i in $(seq 200); do echo $i > src/$i.h; done
+    rules 'all||cat src/*.h > all'
+    build -j 4 all || return 1
+    [ $(wc -l < all) -eq 200 ] || return 1
+    grep -q ' 0 spare workers started' log.txt
+}
+
+# Each job blocks on the next; with one token the spares are what runs
+# the rules they wait for, one per blocked job
+test_blocked_chain() {
+    rules 'a||cat b > a' 'b||cat c > b' 'c||echo c > c'
+    build -j 1 a || return 1
+    [ "$(cat a)" = c ] || return 1
+    grep -q ' 2 spare workers started' log.txt
+}
+
+# A job that blocks again and again is stood in for by the same spare
+test_repeated_blocks() {
+    rules 'a||cat b > a; cat c >> a; cat d >> a' 'b||echo b > b' 'c||echo c > c' 'd||echo d > d'
+    build -j 1 a || return 1
+    [ "$(cat a | tr -d '\n')" = bcd ] || return 1
+    grep -q ' 1 spare workers started' log.txt
+}
+
+# A failure cancels the build while a job waits for an output of a rule
+# with early outputs that did not start yet, since the job gave its
+# token to an earlier want: the build fails instead of waiting for it
+test_cancel_early_outputs_wait() {
+    rules 'use||cat slow > /dev/null & sleep 0.2; cat gen.h > use; wait' \
+          'slow||sleep 2; echo slow > slow' \
+          'gen.h||# buildsome: early-outputs|echo gen > gen.h' \
+          'fail||sleep 1; exit 1'
+    build -j 2 use fail
+    [ $? -eq 1 ]
+}
+
+# The core budget follows -j, and a job blocked on an input gives its
+# cores to the one it waits for, so a chain never takes more than one
+test_blocked_cores() {
+    local cmd='i=0; while [ $i -lt 20000 ]; do i=$((i + 1)); done'
+    rules "a||$cmd; cat b > a" "b||$cmd; cat c > b" "c||$cmd; echo c > c"
+    build -j 3 a || return 1
+    grep -q '^Admission: .*/3 cores' log.txt || return 1
+    rm a b c
+    build -j 1 a || return 1
+    local peak=$(sed -n 's/^Admission: .* MiB, \([0-9.]*\)\/1 cores.*/\1/p' log.txt)
+    awk -v peak="$peak" 'BEGIN { exit !(peak > 0.5 && peak <= 1) }'
+}
+
+# Rules fast enough last time run in one supervising shell, each in a
+# process group of its own and under the same shell as when unbatched
+test_batched_commands() {
+    local cmd='readlink -f /proc/$$/exe > $0; cut -d" " -f5 /proc/$$/stat >> $0; echo $$ >> $0'
+    rules "a||${cmd//\$0/a}" "b||${cmd//\$0/b}" "c||${cmd//\$0/c}"
+    build -j 1 a b c || return 1
+    local unbatched=$(head -1 a)
+    rm a b c
+    build -j 1 -b 1000 a b c || return 1
+    grep -q 'Batched 3 rules into 1 shells' log.txt || return 1
+    for out in a b c; do
+        [ "$(head -1 $out)" = "$unbatched" ] || return 1
+        [ "$(sed -n 2p $out)" = "$(sed -n 3p $out)" ] || return 1
+    done
+}
+
+# A batched command that fails fails the build, and the supervising shell
+# goes on to report the status of the others
+test_batched_failure() {
+    rules 'a||echo a > a' 'b||test ! -e fail; echo b > b' 'c||echo c > c'
+    build -j 1 a b c || return 1
+    rm a b c
+    touch fail
+    build -k -j 1 -b 1000 a b c
+    [ $? -eq 1 ] || return 1
+    grep -q 'Batched 3 rules into 1 shells' log.txt || return 1
+    [ "$(cat a c)" = "$(printf 'a\nc')" ] && [ ! -e b ]
+}
+
+failures=0
+for test in $(declare -F | awk '{print $3}' | grep '^test_'); do
+    dir=$(mktemp -d)
+    cp "$SRC/out/fs_override.so" "$dir/"
+    if (cd "$dir" && $test); then
+        echo "PASS $test"
+    else
+        echo "FAIL $test"
+        cat "$dir/log.txt" 2>/dev/null
+        failures=$((failures + 1))
+    fi
+    rm -rf "$dir"
+done
+[ $failures -eq 0 ]
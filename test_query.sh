@@ -0,0 +1,25 @@
+#!/bin/bash
+# Query program for test_main.sh. Answers from ./rules in the current
+# directory, one rule per line:
+#   <outputs>|<inputs>|<command>|<command>...
+# Targets no rule outputs are sources.
+print_list() {
+    printf '%s\n' $#
+    [ $# -eq 0 ] || printf '%s\n' "$@"
+}
+
+while read -r target; do
+    commands=() inputs=() outputs=()
+    while IFS='|' read -r rule_outputs rule_inputs rule_commands; do
+        for output in $rule_outputs; do
+            [ "$output" = "$target" ] || continue
+            IFS='|' read -ra commands <<< "$rule_commands"
+            read -ra inputs <<< "$rule_inputs"
+            read -ra outputs <<< "$rule_outputs"
+        done
+        [ ${#outputs[@]} -gt 0 ] && break
+    done < rules
+    print_list "${commands[@]}"
+    print_list "${inputs[@]}"
+    print_list "${outputs[@]}"
+done
@@ -0,0 +1,140 @@
+#include "symbol_table.h"
+#include "target_table.h"
+#include "dense_array.h"
+#include "assert.h"
+
+#include <iostream>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define THREADS_COUNT 8
+#define NAMES_COUNT 10000
+#define VALUES_COUNT 5000 // per thread
+
+static std::string target_name(uint32_t i)
+{
+    return "out/dir" + std::to_string(i % 97) + "/target" + std::to_string(i) + ".o";
+}
+
+// Every thread interns all the names, each starting at a different one,
+// while another thread reads back each name as soon as it is interned
+static void test_symbol_table()
+{
+    SymbolTable symbols;
+    std::vector<std::vector<TargetId> > ids(THREADS_COUNT, std::vector<TargetId>(NAMES_COUNT));
+    std::atomic<bool> done(false);
+
+    std::thread reader([&symbols, &done]() {
+            TargetId id = 0;
+            while (!done) {
+                for (const uint32_t size = symbols.size(); id < size; id++) {
+                    const std::string name = symbols.name(id);
+                    ASSERT(name.compare(0, 7, "out/dir") == 0);
+                    ASSERT(name.compare(name.size() - 2, 2, ".o") == 0);
+                }
+            }
+        });
+    std::vector<std::thread> writers;
+    for (uint32_t t = 0; t < THREADS_COUNT; t++) {
+        writers.emplace_back([t, &symbols, &ids]() {
+                for (uint32_t n = 0; n < NAMES_COUNT; n++) {
+                    const uint32_t i = (n + t * (NAMES_COUNT / THREADS_COUNT)) % NAMES_COUNT;
+                    ids[t][i] = symbols.intern(target_name(i));
+                }
+            });
+    }
+    for (auto &writer : writers) writer.join();
+    done = true;
+    reader.join();
+
+    ASSERT(symbols.size() == NAMES_COUNT);
+    for (uint32_t i = 0; i < NAMES_COUNT; i++) {
+        for (uint32_t t = 1; t < THREADS_COUNT; t++) ASSERT(ids[t][i] == ids[0][i]);
+        ASSERT(symbols.name(ids[0][i]) == target_name(i));
+        ASSERT(symbols.intern(target_name(i)) == ids[0][i]);
+    }
+}
+
+// Appends from several threads, with chunks small enough that they race
+// to allocate them, while a reader checks that each element is fully
+// written by the time it is published
+static void test_dense_array()
+{
+    DenseArray<uint64_t, 4> values;
+    std::vector<std::vector<uint32_t> > idxs(THREADS_COUNT);
+    std::atomic<bool> done(false);
+
+    std::thread reader([&values, &done]() {
+            uint32_t idx = 0;
+            while (!done) {
+                for (const uint32_t size = values.size(); idx < size; idx++) ASSERT(values[idx] != 0);
+            }
+        });
+    std::vector<std::thread> writers;
+    for (uint32_t t = 0; t < THREADS_COUNT; t++) {
+        writers.emplace_back([t, &values, &idxs]() {
+                for (uint64_t n = 0; n < VALUES_COUNT; n++) {
+                    idxs[t].push_back(values.push_back(((uint64_t)t << 32) | (n + 1)));
+                }
+            });
+    }
+    for (auto &writer : writers) writer.join();
+    done = true;
+    reader.join();
+
+    ASSERT(values.size() == THREADS_COUNT * VALUES_COUNT);
+    std::vector<bool> seen(values.size(), false);
+    for (uint32_t t = 0; t < THREADS_COUNT; t++) {
+        for (uint64_t n = 0; n < VALUES_COUNT; n++) {
+            const uint32_t idx = idxs[t][n];
+            ASSERT(!seen[idx]);
+            seen[idx] = true;
+            ASSERT(values[idx] == (((uint64_t)t << 32) | (n + 1)));
+        }
+    }
+}
+
+// Threads race to resolve the same targets; the first one to get to each
+// wins and everyone reads its rule back. The targets span many chunks.
+static void test_target_table()
+{
+    TargetTable targets;
+    const TargetId stride = 37;
+    for (TargetId target = 0; target < NAMES_COUNT; target++) {
+        ASSERT(targets.get(target * stride) == UNRESOLVED_TARGET);
+    }
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < THREADS_COUNT; t++) {
+        threads.emplace_back([t, &targets, stride]() {
+                for (TargetId target = 0; target < NAMES_COUNT; target++) {
+                    // Some targets have no rule building them
+                    const RuleId rule_id = (target % 5 == 0) ? NO_RULE : (target * THREADS_COUNT + t);
+                    targets.set_if_unresolved(target * stride, rule_id);
+                    const RuleId got = targets.get(target * stride);
+                    ASSERT(got != UNRESOLVED_TARGET);
+                    ASSERT((target % 5 == 0) ? (got == NO_RULE) : (got / THREADS_COUNT == target));
+                }
+            });
+    }
+    for (auto &thread : threads) thread.join();
+
+    for (TargetId target = 0; target < NAMES_COUNT; target++) {
+        const RuleId rule_id = targets.get(target * stride);
+        ASSERT((target % 5 == 0) ? (rule_id == NO_RULE) : (rule_id / THREADS_COUNT == target));
+        ASSERT(targets.get(target * stride + 1) == UNRESOLVED_TARGET);
+        targets.set(target * stride, 7);
+        ASSERT(targets.get(target * stride) == 7);
+    }
+}
+
+int main()
+{
+    test_symbol_table();
+    test_dense_array();
+    test_target_table();
+    std::cout << "OK" << std::endl;
+    return 0;
+}
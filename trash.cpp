@@ -0,0 +1,135 @@
+#include "trash.h"
+#include "assert.h"
+
+extern "C" {
+#include <dirent.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+}
+
+#define REAPER_NICE 19
+// From linux/ioprio.h
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+#define LOG(x) DEBUG(x)
+
+static int remove_fn(const char *fpath, const struct stat *sb UNUSED_ATTR,
+                     int typeflag, struct FTW *ftwbuf UNUSED_ATTR)
+{
+    if (typeflag == FTW_DP) {
+        LOG("rmdir " << fpath);
+        ASSERT(0 == rmdir(fpath));
+    } else {
+        LOG("unlink " << fpath);
+        ASSERT(0 == unlink(fpath));
+    }
+    return 0;
+}
+
+// Symlinks are removed, not followed
+static void remove_tree(const std::string &path)
+{
+    struct stat path_stat;
+    if (0 != lstat(path.c_str(), &path_stat)) {
+        ASSERT(ENOENT == errno);
+        return;
+    }
+    if (!S_ISDIR(path_stat.st_mode)) {
+        LOG("unlink " << path);
+        ASSERT(0 == unlink(path.c_str()));
+        return;
+    }
+    const int nopenfd = 10;
+    ASSERT(0 == nftw(path.c_str(), remove_fn, nopenfd, FTW_DEPTH | FTW_PHYS));
+}
+
+Trash::Trash(const std::string &dir_prefix)
+{
+    m_dir = dir_prefix + "." + std::to_string(getpid());
+
+    // What builds that were killed left behind, by the pid in its name
+    const std::string dir_name = dir_prefix.substr(dir_prefix.rfind('/') + 1) + ".";
+    const std::string parent = (dir_prefix.find('/') == std::string::npos)
+        ? std::string(".") : dir_prefix.substr(0, dir_prefix.rfind('/'));
+    DIR *const dir = opendir(parent.c_str());
+    ASSERT(dir != nullptr);
+    while (struct dirent *entry = readdir(dir)) {
+        if (0 != strncmp(entry->d_name, dir_name.c_str(), dir_name.size())) continue;
+        const pid_t owner = atoi(entry->d_name + dir_name.size());
+        if ((owner > 0) && (owner != getpid()) && ((0 == kill(owner, 0)) || (errno != ESRCH))) continue;
+        m_pending.push_back(parent + "/" + entry->d_name);
+    }
+    closedir(dir);
+
+    for (uint32_t attempt = 0; 0 != mkdir(m_dir.c_str(), 0700); attempt++) {
+        // Left behind by someone with our pid, and queued above
+        ASSERT(EEXIST == errno);
+        m_dir = dir_prefix + "." + std::to_string(getpid()) + "." + std::to_string(attempt);
+    }
+    m_reaper = new std::thread(&Trash::reaper_main, this);
+}
+
+Trash::~Trash()
+{
+    {
+        std::unique_lock<std::mutex> lck (m_mtx);
+        m_stopping = true;
+        m_cv.notify_all();
+    }
+    m_reaper->join();
+    delete m_reaper;
+    ASSERT(0 == rmdir(m_dir.c_str()));
+}
+
+bool Trash::discard(const std::string &path)
+{
+    std::string entry;
+    {
+        std::unique_lock<std::mutex> lck (m_mtx);
+        entry = m_dir + "/" + std::to_string(m_next_entry++);
+    }
+    if (0 == rename(path.c_str(), entry.c_str())) {
+        LOG("rename " << path << " " << entry);
+        std::unique_lock<std::mutex> lck (m_mtx);
+        m_pending.push_back(entry);
+        m_cv.notify_all();
+        return true;
+    }
+    if (ENOENT == errno) return false;
+    LOG("rename " << path << " failed, errno: " << errno);
+    struct stat path_stat;
+    if ((0 != lstat(path.c_str(), &path_stat)) && (ENOENT == errno)) return false;
+    remove_tree(path);
+    return true;
+}
+
+void Trash::reaper_main()
+{
+    // Nothing waits for the deletes, so the commands come first. Both are
+    // best effort: the reaper works the same at normal priority.
+    const pid_t tid = syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, REAPER_NICE);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    while (true) {
+        std::string entry;
+        {
+            std::unique_lock<std::mutex> lck (m_mtx);
+            while (m_pending.empty() && !m_stopping) m_cv.wait(lck);
+            if (m_pending.empty()) return;
+            entry = m_pending.front();
+            m_pending.pop_front();
+        }
+        remove_tree(entry);
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/* Where outputs go before their rule runs again. Discarding one is a
+ * single rename into a directory of this build's, however big a tree it
+ * is; a reaper thread at the lowest CPU and IO priority deletes what is
+ * there in the background.
+ *
+ * Trash left behind by a build that did not get to finish is reaped too.
+ * The destructor returns once everything is deleted. */
+class Trash {
+public:
+    // The directory is created next to the outputs, so renaming into it
+    // stays on their filesystem
+    explicit Trash(const std::string &dir_prefix);
+    ~Trash();
+
+    // Returns whether there was anything at path. The rare path that
+    // cannot be renamed here, such as one on another filesystem, is
+    // deleted right away instead.
+    bool discard(const std::string &path);
+
+    Trash(const Trash &) =delete;
+    Trash& operator=(const Trash &) =delete;
+
+private:
+    void reaper_main();
+
+    std::string m_dir;
+    uint64_t m_next_entry = 0;
+
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::deque<std::string> m_pending; // renamed, not yet deleted
+    bool m_stopping = false;
+    std::thread *m_reaper;
+};